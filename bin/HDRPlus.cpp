@@ -1,100 +1,243 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-#include <Halide.h>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <include/stb_image_write.h>
-
-#include <hdrplus_pipeline.h>
 #include <src/Burst.h>
+#include <src/BurstPyramid.h>
+#include <src/HdrPlusContext.h>
+#include <src/ImageWriter.h>
+#include <src/MemoryEstimate.h>
+#include <src/MergedCache.h>
+#include <src/MipiRaw.h>
+#include <src/ZslRingBuffer.h>
 
-/*
- * HDRPlus Class -- Houses file I/O, defines pipeline attributes and calls
- * processes main stages of the pipeline.
- */
-class HDRPlus {
-  const Burst &burst;
-
-public:
-  const Compression c;
-  const Gain g;
-
-  HDRPlus(const Burst &burst, const Compression c, const Gain g)
-      : burst(burst), c(c), g(g) {}
+namespace {
 
-  Halide::Runtime::Buffer<uint8_t> process() {
-    const int width = burst.GetWidth();
-    const int height = burst.GetHeight();
+// Largest mean absolute difference per sample between a render from a ZSL
+// ring buffer and the plain pipeline on the same frames, for --verify-zsl. The ring mirrors the
+// stored pyramid layers at the frame border instead of the frames, so tiles
+// along the border may differ slightly; a wrong frame order or reference
+// shifts the whole image.
+constexpr double kZslTolerance = 0.5;
 
-    Halide::Runtime::Buffer<uint8_t> output_img(3, width, height);
-
-    std::cerr << "Black point: " << burst.GetBlackLevel() << std::endl;
-    std::cerr << "White point: " << burst.GetWhiteLevel() << std::endl;
-
-    const WhiteBalance wb = burst.GetWhiteBalance();
-    std::cerr << "RGGB: " << wb.r << " " << wb.g0 << " " << wb.g1 << " " << wb.b
-              << std::endl;
+// Inserts the parameters of one output of a sweep before the extension of
+// out_name, e.g. output.png becomes output_c3.8_g1.1.png.
+std::string SweepOutputName(const std::string &out_name,
+                            const ToneParams &params) {
+  const size_t dot = out_name.rfind('.');
+  std::ostringstream name;
+  name << out_name.substr(0, dot) << "_c" << params.compression << "_g"
+       << params.gain;
+  if (dot != std::string::npos) {
+    name << out_name.substr(dot);
+  }
+  return name.str();
+}
 
-    Halide::Runtime::Buffer<uint16_t> imgs = burst.ToBuffer();
-    if (imgs.dimensions() != 3 || imgs.extent(2) < 2) {
-      throw std::invalid_argument(
-          "The input of HDRPlus must be a 3-dimensional buffer with at least "
-          "two channels.");
+double MeanAbsoluteDifference(const Halide::Runtime::Buffer<uint8_t> &a,
+                              const Halide::Runtime::Buffer<uint8_t> &b) {
+  double sum = 0.0;
+  for (int y = 0; y < a.dim(2).extent(); y++) {
+    for (int x = 0; x < a.dim(1).extent(); x++) {
+      for (int c = 0; c < 3; c++) {
+        sum += std::abs(int(a(c, x, y)) - int(b(c, x, y)));
+      }
     }
+  }
+  return sum / (3.0 * a.dim(1).extent() * a.dim(2).extent());
+}
 
-    const int cfa_pattern = static_cast<int>(burst.GetCfaPattern());
-    auto ccm = burst.GetColorCorrectionMatrix();
-    hdrplus_pipeline(imgs, burst.GetBlackLevel(), burst.GetWhiteLevel(), wb.r,
-                     wb.g0, wb.g1, wb.b, cfa_pattern, ccm, c, g, output_img);
+} // namespace
 
-    // transpose to account for interleaved layout
-    output_img.transpose(0, 1);
-    output_img.transpose(1, 2);
+int main(int argc, char *argv[]) {
 
-    return output_img;
+  if (argc == 5 && std::string(argv[1]) == "--estimate") {
+    std::cout << EstimatePeakMemory(PipelineKind::HDR_PLUS, std::stoi(argv[2]),
+                                    std::stoi(argv[3]), std::stoi(argv[4]))
+              << std::endl;
+    return 0;
   }
 
-  static bool save_png(const std::string &dir_path, const std::string &img_name,
-                       const Halide::Runtime::Buffer<uint8_t> &img) {
-    const std::string img_path = dir_path + "/" + img_name;
-
-    const int stride_in_bytes = img.width() * img.channels();
-    if (!stbi_write_png(img_path.c_str(), img.width(), img.height(),
-                        img.channels(), img.data(), stride_in_bytes)) {
-      std::cerr << "Unable to write output image '" << img_name << "'"
-                << std::endl;
-      return false;
+  if (argc >= 4 && std::string(argv[1]) == "--probe") {
+    const std::vector<std::string> inputs(argv + 3, argv + argc);
+    const auto frames = Burst::Probe(argv[2], inputs);
+    for (const auto &frame : frames) {
+      std::cout << frame << std::endl;
     }
-    return true;
+    const auto problems = Burst::CheckConsistency(frames);
+    for (const auto &problem : problems) {
+      std::cout << problem << std::endl;
+    }
+    std::cout << (problems.empty() ? "consistent" : "inconsistent")
+              << std::endl;
+    return problems.empty() ? 0 : 1;
   }
-};
-
-int main(int argc, char *argv[]) {
 
   if (argc < 5) {
     std::cerr << "Usage: " << argv[0]
-              << " [-c comp -g gain (optional)] dir_path out_img raw_img1 "
-                 "raw_img2 [...]"
+              << " [-c comp -g gain (optional)] [--huge-pages] [--mmap] "
+                 "[--threads n] [--preview factor] [--roi x,y,width,height] "
+                 "[--memory-budget MiB] [--mipi sidecar] [--cache dir] "
+                 "[--pyramid-cache dir] "
+                 "[--sweep c,g[:c,g...]] [--sweep-jobs n] [--auto-reference K] "
+                 "[--reject-frames factor] [--assume-static] [--detect-static] "
+                 "[--coarse-u8] [--stream] [--zsl N] [--verify-zsl] "
+                 "dir_path out_img raw_img1 raw_img2 [...]\n"
+              << "       " << argv[0] << " --estimate width height frames\n"
+              << "       " << argv[0]
+              << " --probe dir_path raw_img1 raw_img2 [...]"
               << std::endl;
     return 1;
   }
 
-  Compression c = 3.8f;
-  Gain g = 1.1f;
+  ProcessOptions options;
+  bool huge_pages = false;
+  bool use_mmap = false;
+  int num_threads = 0;
+  std::string mipi_sidecar;
+  std::string cache_dir;
+  std::string pyramid_cache_dir;
+  std::vector<ToneParams> sweep_params;
+  int sweep_jobs = 1;
+  int auto_reference = 0;
+  float reject_factor = 0.f;
+  bool detect_static = false;
+  bool stream = false;
+  int zsl = 0;
+  bool verify_zsl = false;
 
   int i = 1;
 
-  while (argv[i][0] == '-') {
-    if (argv[i][1] == 'c') {
-      c = std::stof(argv[++i]);
+  while (i < argc && argv[i][0] == '-') {
+    if (std::string(argv[i]) == "--huge-pages") {
+      huge_pages = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--mmap") {
+      use_mmap = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--threads") {
+      num_threads = std::stoi(argv[++i]);
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--preview") {
+      options.downsample = std::stoi(argv[++i]);
+      if (options.downsample < 2 || options.downsample % 2 != 0) {
+        std::cerr << "Preview factor must be an even number such as 4 or 8"
+                  << std::endl;
+        return 1;
+      }
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--roi") {
+      ImageRegion region{};
+      if (std::sscanf(argv[++i], "%d,%d,%d,%d", &region.x, &region.y,
+                      &region.width, &region.height) != 4) {
+        std::cerr << "Region of interest must be given as x,y,width,height"
+                  << std::endl;
+        return 1;
+      }
+      options.roi = region;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--mipi") {
+      mipi_sidecar = argv[++i];
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--cache") {
+      cache_dir = argv[++i];
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--pyramid-cache") {
+      pyramid_cache_dir = argv[++i];
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--sweep") {
+      std::istringstream pairs(argv[++i]);
+      std::string pair;
+      while (std::getline(pairs, pair, ':')) {
+        ToneParams params{};
+        if (std::sscanf(pair.c_str(), "%f,%f", &params.compression,
+                        &params.gain) != 2) {
+          std::cerr << "Sweep parameters must be given as "
+                       "comp,gain[:comp,gain...]"
+                    << std::endl;
+          return 1;
+        }
+        sweep_params.push_back(params);
+      }
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--sweep-jobs") {
+      sweep_jobs = std::stoi(argv[++i]);
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--auto-reference") {
+      auto_reference = std::stoi(argv[++i]);
+      if (auto_reference < 1) {
+        std::cerr << "The number of reference candidates must be positive"
+                  << std::endl;
+        return 1;
+      }
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--reject-frames") {
+      reject_factor = std::stof(argv[++i]);
+      if (reject_factor < 1.f) {
+        std::cerr << "The rejection factor must be at least 1" << std::endl;
+        return 1;
+      }
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--assume-static") {
+      options.assume_static = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--coarse-u8") {
+      options.coarse_u8 = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--detect-static") {
+      detect_static = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--stream") {
+      stream = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--zsl") {
+      zsl = std::stoi(argv[++i]);
+      if (zsl < 2) {
+        std::cerr << "A ZSL ring buffer must hold at least two frames"
+                  << std::endl;
+        return 1;
+      }
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--verify-zsl") {
+      verify_zsl = true;
+      i++;
+      continue;
+    } else if (std::string(argv[i]) == "--memory-budget") {
+      options.memory_budget = std::stoull(argv[++i]) * 1024 * 1024;
+      i++;
+      continue;
+    } else if (argv[i][1] == 'c') {
+      options.compression = std::stof(argv[++i]);
       i++;
       continue;
     } else if (argv[i][1] == 'g') {
-      g = std::stof(argv[++i]);
+      options.gain = std::stof(argv[++i]);
       i++;
       continue;
     } else {
@@ -105,8 +248,14 @@ int main(int argc, char *argv[]) {
 
   if (argc - i < 4) {
     std::cerr << "Usage: " << argv[0]
-              << " [-c comp -g gain (optional)] dir_path out_img raw_img1 "
-                 "raw_img2 [...]"
+              << " [-c comp -g gain (optional)] [--huge-pages] [--mmap] "
+                 "[--threads n] [--preview factor] [--roi x,y,width,height] "
+                 "[--memory-budget MiB] [--mipi sidecar] [--cache dir] "
+                 "[--pyramid-cache dir] "
+                 "[--sweep c,g[:c,g...]] [--sweep-jobs n] [--auto-reference K] "
+                 "[--reject-frames factor] [--assume-static] [--detect-static] "
+                 "[--coarse-u8] [--stream] [--zsl N] [--verify-zsl] "
+                 "dir_path out_img raw_img1 raw_img2 [...]"
               << std::endl;
     return 1;
   }
@@ -119,14 +268,322 @@ int main(int argc, char *argv[]) {
     in_names.emplace_back(argv[i++]);
   }
 
-  Burst burst(dir_path, in_names);
+  // The context serves the intermediates of the pipeline from a pool, so that
+  // repeated allocations of the same size reuse already faulted-in pages.
+  HdrPlusContext context(num_threads, huge_pages);
 
-  HDRPlus hdr_plus(burst, c, g);
+  std::vector<std::string> paths;
+  for (const auto &name : in_names) {
+    paths.push_back(dir_path + "/" + name);
+  }
 
-  Halide::Runtime::Buffer<uint8_t> output = hdr_plus.process();
+  const bool sweep = !sweep_params.empty();
+  if (sweep && (options.downsample > 1 || options.roi)) {
+    std::cerr << "A sweep renders whole frames at full resolution"
+              << std::endl;
+    return 1;
+  }
+  // The pyramid cache renders from the alignment pyramids of the frames. An
+  // automatic reference, frame rejection and static scene detection otherwise
+  // only choose the frames and the pipeline that merges them.
+  const bool use_pyramid = !pyramid_cache_dir.empty();
+  const bool choose_frames = auto_reference > 0 || reject_factor > 0.f ||
+                             detect_static || use_pyramid;
+  if (choose_frames &&
+      (options.downsample > 1 || sweep || stream || !cache_dir.empty())) {
+    std::cerr << "An automatic reference, frame rejection, static scene "
+                 "detection or the pyramid cache cannot be combined with a "
+                 "preview, a sweep, a streaming merge or the merged frame "
+                 "cache"
+              << std::endl;
+    return 1;
+  }
+  if (options.assume_static && (sweep || stream || !cache_dir.empty())) {
+    std::cerr << "A static scene cannot be assumed for a sweep, a streaming "
+                 "merge or the merged frame cache"
+              << std::endl;
+    return 1;
+  }
+  if (options.coarse_u8 && (sweep || stream || !cache_dir.empty())) {
+    std::cerr << "The 8-bit coarse search is not available for a sweep, a "
+                 "streaming merge or the merged frame cache"
+              << std::endl;
+    return 1;
+  }
+  if (zsl > 0 && (options.downsample > 1 || sweep || stream ||
+                  choose_frames || !cache_dir.empty())) {
+    std::cerr << "--zsl N cannot be combined with a preview, a sweep, a "
+                 "streaming merge, the merged frame cache or the options that "
+                 "choose frames"
+              << std::endl;
+    return 1;
+  }
+  // The ring buffer wraps around once the frames exceed its capacity, which is
+  // the case the check against the plain pipeline is meant to cover.
+  if (verify_zsl && (zsl == 0 || static_cast<int>(in_names.size()) <= zsl)) {
+    std::cerr << "--verify-zsl needs --zsl N and more than N frames"
+              << std::endl;
+    return 1;
+  }
+  // A streaming merge decodes the frames with LibRaw one at a time, and only
+  // merges at full resolution.
+  if (stream && (options.downsample > 1 || !mipi_sidecar.empty())) {
+    std::cerr << "A streaming merge cannot be combined with a preview or MIPI "
+                 "input"
+              << std::endl;
+    return 1;
+  }
+
+  // With a cache, a burst that was merged before is not decoded, aligned or
+  // merged again: its merged frame is read back and only finish runs. Previews
+  // skip the cache, as they never merge at full resolution. A sweep and a
+  // streaming merge always start from the merged frame.
+  const bool use_cache = !cache_dir.empty() && options.downsample == 1;
+  const bool use_merged = use_cache || sweep || stream;
+  Halide::Runtime::Buffer<uint16_t> merged;
+  BurstMetadata metadata;
+  bool cache_hit = false;
+  std::string cache_key;
+  std::vector<std::string> key_paths = paths;
+  if (!mipi_sidecar.empty()) {
+    key_paths.push_back(mipi_sidecar);
+  }
+  if (use_cache) {
+    cache_key = MergedCache::Key(key_paths);
+    cache_hit = MergedCache(cache_dir).Load(cache_key, merged, metadata);
+    std::cerr << "Merged frame cache " << (cache_hit ? "hit" : "miss") << ": "
+              << cache_key << std::endl;
+  }
+
+  // With a pyramid cache, a burst whose pyramids were computed before is not
+  // decoded again: its frames and pyramids are read back, and only the
+  // alignment search, the merge and finish run. A missing or stale entry is
+  // computed and saved when the burst is rendered.
+  std::optional<BurstPyramid> pyramid;
+  std::string pyramid_path;
+  if (!pyramid_cache_dir.empty()) {
+    std::filesystem::create_directories(pyramid_cache_dir);
+    pyramid_path =
+        pyramid_cache_dir + "/" + MergedCache::Key(key_paths) + ".pyramid";
+    try {
+      pyramid = BurstPyramid::Load(pyramid_path, metadata);
+    } catch (const std::runtime_error &) {
+      // not cached yet
+    }
+    std::cerr << "Pyramid cache " << (pyramid ? "hit" : "miss") << ": "
+              << pyramid_path << std::endl;
+  }
+
+  // Frames are either decoded by LibRaw or, with a sidecar describing them,
+  // unpacked from MIPI RAW10/RAW12 files.
+  Halide::Runtime::Buffer<uint16_t> frames;
+  if (cache_hit || pyramid) {
+    // nothing to decode
+  } else if (stream) {
+    // Frames are decoded one at a time, each while the previous one is
+    // merged, and checked against the reference as they are opened.
+    const std::string &ref_path = paths[0];
+    const RawImage raw =
+        use_mmap ? RawImage(ref_path, std::make_shared<MappedFile>(ref_path))
+                 : RawImage(ref_path);
+    const FrameInfo reference = raw.GetInfo();
+    metadata = raw.GetMetadata();
+    merged = context.AlignAndMerge(
+        raw.GetWidth(), raw.GetHeight(), static_cast<int>(in_names.size()),
+        [&](int n, Halide::Runtime::Buffer<uint16_t> &frame) {
+          if (n == 0) {
+            raw.CopyToBuffer(frame);
+          } else {
+            Burst::DecodeFrame(dir_path, in_names[n], reference, use_mmap,
+                               frame);
+          }
+        });
+    if (use_cache) {
+      MergedCache(cache_dir).Store(cache_key, merged, metadata);
+    }
+  } else if (!mipi_sidecar.empty()) {
+    MipiBurst burst(mipi_sidecar, paths);
+    frames = burst.GetFrames();
+    metadata = burst.GetMetadata();
+  } else {
+    Burst burst(dir_path, in_names, use_mmap);
+    frames = burst.ToBuffer();
+    metadata = burst.GetMetadata();
+  }
+  if (use_merged && !cache_hit && !stream) {
+    merged = context.AlignAndMerge(frames);
+    if (use_cache) {
+      MergedCache(cache_dir).Store(cache_key, merged, metadata);
+    }
+  }
+  const int width = use_merged ? merged.width()
+                    : pyramid  ? pyramid->GetWidth()
+                               : frames.width();
+  const int height = use_merged ? merged.height()
+                     : pyramid  ? pyramid->GetHeight()
+                                : frames.height();
+
+  std::cerr << "Black point: " << metadata.black_level << std::endl;
+  std::cerr << "White point: " << metadata.white_level << std::endl;
 
-  if (!HDRPlus::save_png(dir_path, out_name, output)) {
-    return EXIT_FAILURE;
+  const WhiteBalance &wb = metadata.white_balance;
+  std::cerr << "RGGB: " << wb.r << " " << wb.g0 << " " << wb.g1 << " " << wb.b
+            << std::endl;
+
+  // The output is encoded as PNG or JPEG depending on the extension of
+  // out_name, while the pipeline produces it.
+  if (sweep) {
+    context.Sweep(
+        merged, metadata, sweep_params,
+        [&](size_t index, const Halide::Runtime::Buffer<uint8_t> &image) {
+          const std::string name =
+              SweepOutputName(out_name, sweep_params[index]);
+          ImageWriter writer(dir_path + "/" + name, width, height);
+          writer.WriteRows(image);
+          writer.Finish();
+          std::cerr << "Wrote " << name << std::endl;
+        },
+        sweep_jobs);
+  } else {
+    const ImageRegion region = context.GetOutputRegion(width, height, options);
+    double zsl_difference = 0.0;
+    ImageWriter writer(dir_path + "/" + out_name, region.width, region.height);
+    const auto write_rows =
+        [&](const Halide::Runtime::Buffer<uint8_t> &rows) {
+          writer.WriteRows(rows);
+        };
+    if (use_merged) {
+      context.Finish(merged, metadata, options, write_rows);
+    } else if (zsl > 0 && !verify_zsl) {
+      // The frames arrive oldest first in a ring of the last 'zsl' of them,
+      // which is rendered as on shutter press, with the newest frame as the
+      // reference.
+      ZslRingBuffer ring(frames.width(), frames.height(), zsl);
+      for (int n = 0; n < frames.extent(2); n++) {
+        ring.Push(frames.sliced(2, n));
+      }
+      context.Process(ring, ring.GetCount(), metadata, options, write_rows);
+    } else if (zsl > 0) {
+      // As above, and the plain pipeline renders the same frames, newest
+      // first, for comparison.
+      const int num_frames = frames.extent(2);
+      ZslRingBuffer ring(frames.width(), frames.height(), zsl);
+      for (int n = 0; n < num_frames; n++) {
+        ring.Push(frames.sliced(2, n));
+      }
+      const auto output = context.Process(ring, zsl, metadata, options);
+      writer.WriteRows(output);
+
+      Halide::Runtime::Buffer<uint16_t> newest(frames.width(),
+                                               frames.height(), zsl);
+      for (int n = 0; n < zsl; n++) {
+        auto slice = newest.sliced(2, n);
+        slice.copy_from(frames.sliced(2, num_frames - 1 - n));
+      }
+      const auto expected = context.Process(newest, metadata, options);
+      zsl_difference = MeanAbsoluteDifference(output, expected);
+      std::cerr << "ZSL render differs from the plain pipeline by "
+                << zsl_difference << " per sample" << std::endl;
+    } else if (use_pyramid) {
+      // The burst is rendered from its pyramids in the order of their frame
+      // map, so neither choice moves any frame.
+      if (!pyramid) {
+        pyramid.emplace(frames);
+        if (!pyramid_path.empty()) {
+          pyramid->Save(pyramid_path, metadata);
+        }
+      }
+      // The sharpest of the first frames becomes the reference.
+      if (auto_reference > 0) {
+        pyramid->SetReference(pyramid->SharpestFrame(auto_reference));
+        std::cerr << "Reference frame: " << in_names[pyramid->GetReference()]
+                  << std::endl;
+      }
+      // Frames that do not align on the coarsest layer are not merged.
+      if (reject_factor > 0.f) {
+        const int rejected = pyramid->RejectFrames(reject_factor);
+        std::cerr << "Rejected " << rejected << " of "
+                  << pyramid->GetNumFrames() << " frames" << std::endl;
+      }
+      // A static burst skips the alignment search.
+      if (detect_static && !options.assume_static && pyramid->IsStatic()) {
+        std::cerr << "Static scene detected" << std::endl;
+        options.assume_static = true;
+      }
+      context.Process(*pyramid, metadata, options, write_rows);
+    } else {
+      // The sharpest of the first frames becomes the reference, scored on
+      // those frames alone, and the pipeline merges the rest onto it.
+      if (auto_reference > 0) {
+        const int reference = context.SharpestFrame(frames, auto_reference);
+        options.frame_map = {reference};
+        for (int n = 0; n < frames.extent(2); n++) {
+          if (n != reference) {
+            options.frame_map.push_back(n);
+          }
+        }
+        std::cerr << "Reference frame: " << in_names[reference] << std::endl;
+      }
+      // Frames that do not align on the coarsest layer are not merged.
+      if (reject_factor > 0.f) {
+        const std::vector<int> kept =
+            context.RejectFrames(frames, options.frame_map, reject_factor);
+        const int rejected = frames.extent(2) - static_cast<int>(kept.size());
+        std::cerr << "Rejected " << rejected << " of " << frames.extent(2)
+                  << " frames" << std::endl;
+        options.frame_map = kept;
+      }
+      // A static burst skips the alignment search.
+      if (detect_static && !options.assume_static &&
+          context.IsStatic(frames, options.frame_map)) {
+        std::cerr << "Static scene detected" << std::endl;
+        options.assume_static = true;
+      }
+      context.Process(frames, metadata, options, write_rows);
+    }
+    writer.Finish();
+    if (zsl_difference > kZslTolerance) {
+      std::cerr << "The ZSL render does not match the plain pipeline"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  // The finishing stages do not depend on the number of frames. The estimate
+  // covers the render alone, not the passes that choose frames, nor copies of
+  // the burst made for --verify-zsl, so a larger high-water mark is reported
+  // rather than failing a run whose output is already written.
+  const int num_frames = cache_hit ? 1 : static_cast<int>(in_names.size());
+  const PipelineKind kind =
+      use_merged ? PipelineKind::FINISH : PipelineKind::HDR_PLUS;
+  const AlignParams params = HdrPlusContext::GetAlignParams(options);
+  size_t predicted = EstimatePipelineMemory(
+      kind, width, height, num_frames,
+      options.memory_budget > 0 && !sweep
+          ? HdrPlusContext::BandRows(width, height, num_frames,
+                                     options.memory_budget, kind, params)
+          : height,
+      params);
+  if (sweep) {
+    // the tone stages of up to sweep_jobs pairs run at the same time
+    predicted = std::max(
+        predicted, std::min<size_t>(sweep_jobs, sweep_params.size()) *
+                       EstimatePipelineMemory(PipelineKind::TONE, width,
+                                              height, num_frames, height,
+                                              params));
+  }
+  if (use_merged && !cache_hit) {
+    predicted = std::max(predicted, EstimatePipelineMemory(
+                                        PipelineKind::ALIGN_AND_MERGE, width,
+                                        height, num_frames, height, params));
+  }
+  const size_t high_water_mark = context.GetMemoryPool().GetHighWaterMark();
+  std::cerr << "Pipeline memory high-water mark: "
+            << high_water_mark / (1024 * 1024) << " MiB (predicted "
+            << predicted / (1024 * 1024) << " MiB)" << std::endl;
+  if (!WithinEstimate(high_water_mark, predicted)) {
+    std::cerr << "Warning: the pipeline used more memory than estimated"
+              << std::endl;
   }
 
   return 0;
@@ -1,36 +1,72 @@
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-#include <Halide.h>
-
 #include <src/Burst.h>
+#include <src/HdrPlusContext.h>
+#include <src/MappedFile.h>
+#include <src/MemoryEstimate.h>
 
-#include <align_and_merge.h>
-
-Halide::Runtime::Buffer<uint16_t>
-align_and_merge(Halide::Runtime::Buffer<uint16_t> burst) {
-  if (burst.channels() < 2) {
-    return {};
+int main(int argc, char *argv[]) {
+  if (argc == 5 && std::string(argv[1]) == "--estimate") {
+    std::cout << EstimatePeakMemory(PipelineKind::ALIGN_AND_MERGE,
+                                    std::stoi(argv[2]), std::stoi(argv[3]),
+                                    std::stoi(argv[4]))
+              << std::endl;
+    return 0;
   }
-  Halide::Runtime::Buffer<uint16_t> merged_buffer(burst.width(),
-                                                  burst.height());
-  align_and_merge(burst, merged_buffer);
-  return merged_buffer;
-}
 
-int main(int argc, char *argv[]) {
   if (argc < 3) {
     std::cerr << "Usage: " << argv[0]
-              << " dir_path out_img raw_img1 raw_img2 [...]" << std::endl;
+              << " [--huge-pages] [--mmap] [--stream]"
+              << " [--compression deflate|none]"
+              << " dir_path out_img raw_img1 raw_img2 [...]\n"
+              << "       " << argv[0] << " --estimate width height frames"
+              << std::endl;
     return 1;
   }
 
+  bool huge_pages = false;
+  bool use_mmap = false;
+  bool stream = false;
+  DngCompression compression = DngCompression::DEFLATE;
+
   int i = 1;
+  while (i < argc && argv[i][0] == '-') {
+    if (std::string(argv[i]) == "--huge-pages") {
+      huge_pages = true;
+      i++;
+    } else if (std::string(argv[i]) == "--mmap") {
+      use_mmap = true;
+      i++;
+    } else if (std::string(argv[i]) == "--stream") {
+      stream = true;
+      i++;
+    } else if (std::string(argv[i]) == "--compression" && i + 1 < argc) {
+      const std::string name = argv[i + 1];
+      if (name == "deflate") {
+        compression = DngCompression::DEFLATE;
+      } else if (name == "none") {
+        compression = DngCompression::NONE;
+      } else {
+        std::cerr << "Invalid compression '" << name << "'" << std::endl;
+        return 1;
+      }
+      i += 2;
+    } else {
+      std::cerr << "Invalid flag '" << argv[i] << "'" << std::endl;
+      return 1;
+    }
+  }
+
   if (argc - i < 3) {
     std::cerr << "Usage: " << argv[0]
+              << " [--huge-pages] [--mmap] [--stream]"
+              << " [--compression deflate|none]"
               << " dir_path out_img raw_img1 raw_img2 [...]" << std::endl;
     return 1;
   }
@@ -42,15 +78,64 @@ int main(int argc, char *argv[]) {
   while (i < argc)
     in_names.push_back(argv[i++]);
 
-  Burst burst(dir_path, in_names);
+  HdrPlusContext context(0, huge_pages);
+  const std::string merged_filename = dir_path + "/" + out_name;
+
+  if (stream) {
+    // Frames are decoded and merged one at a time, so only the reference
+    // pyramid and two frames are held in memory. Each frame is checked against
+    // the reference as it is opened, and decoded while the previous one is
+    // merged.
+    const std::string ref_path = dir_path + "/" + in_names[0];
+    const RawImage raw =
+        use_mmap ? RawImage(ref_path, std::make_shared<MappedFile>(ref_path))
+                 : RawImage(ref_path);
+    const FrameInfo reference = raw.GetInfo();
+    Halide::Runtime::Buffer<uint16_t> merged;
+    try {
+      merged = context.AlignAndMerge(
+          raw.GetWidth(), raw.GetHeight(), static_cast<int>(in_names.size()),
+          [&](int n, Halide::Runtime::Buffer<uint16_t> &frame) {
+            if (n == 0) {
+              raw.CopyToBuffer(frame);
+            } else {
+              Burst::DecodeFrame(dir_path, in_names[n], reference, use_mmap,
+                                 frame);
+            }
+          });
+    } catch (const std::invalid_argument &e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::cerr << "merged " << in_names.size() << " frames, size: "
+              << merged.width() << " " << merged.height() << std::endl;
+    std::cerr << "Pipeline memory high-water mark: "
+              << context.GetMemoryPool().GetHighWaterMark() / (1024 * 1024)
+              << " MiB" << std::endl;
+
+    raw.WriteDng(merged_filename, merged, compression);
+    return EXIT_SUCCESS;
+  }
+
+  Burst burst(dir_path, in_names, use_mmap);
 
-  const auto merged = align_and_merge(burst.ToBuffer());
+  const auto merged = context.AlignAndMerge(burst.ToBuffer());
   std::cerr << "merged size: " << merged.width() << " " << merged.height()
             << std::endl;
+  const size_t predicted = EstimatePipelineMemory(
+      PipelineKind::ALIGN_AND_MERGE, burst.GetWidth(), burst.GetHeight(),
+      static_cast<int>(in_names.size()), burst.GetHeight());
+  const size_t high_water_mark = context.GetMemoryPool().GetHighWaterMark();
+  std::cerr << "Pipeline memory high-water mark: "
+            << high_water_mark / (1024 * 1024) << " MiB (predicted "
+            << predicted / (1024 * 1024) << " MiB)" << std::endl;
 
   const RawImage &raw = burst.GetRaw(0);
-  const std::string merged_filename = dir_path + "/" + out_name;
-  raw.WriteDng(merged_filename, merged);
+  raw.WriteDng(merged_filename, merged, compression);
 
+  if (!WithinEstimate(high_water_mark, predicted)) {
+    std::cerr << "Warning: the pipeline used more memory than estimated"
+              << std::endl;
+  }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#define T_SIZE 32 // Size of a tile in the bayer mosaiced image
+#define T_SIZE_2                                                               \
+  16 // Half of T_SIZE and the size of a tile throughout the alignment pyramid
+
+#define DOWNSAMPLE_RATE                                                        \
+  4 // Rate at which layers of the alignment pyramid are downsampled relative to
+    // each other
+
+// Tile size and search radius the pipelines are built with, set for the whole
+// build by the CMake cache variables of the same name. The host code sizes its
+// tile buffers, bands and memory estimates from them through AlignParams().
+#ifndef HDRPLUS_TILE_SIZE
+#define HDRPLUS_TILE_SIZE T_SIZE
+#endif
+#ifndef HDRPLUS_SEARCH_RADIUS
+#define HDRPLUS_SEARCH_RADIUS 4
+#endif
+
+/*
+ * AlignParams -- Tile size and search radius of the alignment, which trade
+ * speed for quality: larger tiles and a smaller search are faster, smaller
+ * tiles and a larger search follow more motion. The merge blends the tiles of
+ * the alignment, so it takes the same parameters. Generators expose them as
+ * the tile_size and search_radius GeneratorParams, which default to
+ * HDRPLUS_TILE_SIZE and HDRPLUS_SEARCH_RADIUS. This header does not depend on
+ * Halide, so that host code can share the parameters with the pipelines.
+ */
+struct AlignParams {
+  int tile_size = HDRPLUS_TILE_SIZE; // Size of a tile in the bayer mosaiced
+                                     // image; tiles overlap by half
+  int search_radius = HDRPLUS_SEARCH_RADIUS; // Offsets from -search_radius to
+                                             // search_radius - 1 are searched
+                                             // on each layer of the pyramid
+
+  // When set, layers 1 and 2 are quantized to u8 for the search, whose tile
+  // scores then become 8-bit sums of absolute differences. The quantization
+  // keeps the 8 most significant bits below the white level passed to align,
+  // which is then required.
+  bool coarse_u8 = false;
+
+  // Half of tile_size and the size of a tile throughout the alignment pyramid
+  int tile_size_2() const { return tile_size / 2; }
+
+  // Min and max total alignment over the three searched layers, in pixels of
+  // the bayer image. They differ because the search covers an even number of
+  // offsets, which vectorizes better.
+  int min_offset() const { return -2 * search_radius * kOffsetScale; }
+  int max_offset() const { return 2 * (search_radius - 1) * kOffsetScale; }
+
+  // Bits that index an offset of the (2 * search_radius)^2 searched on a
+  // layer. The search packs the index and the score of a tile, a sum of
+  // absolute differences of up to tile_size_2()^2 u16 values, into one u32,
+  // which bounds the tile size and search radius together.
+  int search_index_bits() const {
+    const int search_size = 2 * search_radius;
+    int bits = 0;
+    while ((1 << bits) < search_size * search_size) {
+      bits++;
+    }
+    return bits;
+  }
+
+  // Throws std::invalid_argument unless tiles split evenly into the 2x2 bayer
+  // quads of layer 0 and into halves on it, which takes a multiple of 4 of at
+  // least 8, at least one offset is searched on each side of zero, and the
+  // largest tile score fits next to the offset index in 32 bits. The last
+  // allows tiles of up to 64 with the default search radius of 4.
+  void Validate() const {
+    if (tile_size < 8 || tile_size % 4 != 0) {
+      throw std::invalid_argument(
+          "The alignment tile size must be a multiple of 4 of at least 8.");
+    }
+    if (search_radius < 1 || search_radius > kMaxSearchRadius) {
+      throw std::invalid_argument(
+          "The alignment search radius must be between 1 and " +
+          std::to_string(kMaxSearchRadius) + ".");
+    }
+    const unsigned long long max_score =
+        static_cast<unsigned long long>(tile_size_2()) * tile_size_2() *
+        65535;
+    if (max_score >> (32 - search_index_bits()) != 0) {
+      throw std::invalid_argument(
+          "Alignment tiles of " + std::to_string(tile_size) +
+          " are too large for the scores of a search radius of " +
+          std::to_string(search_radius) + " to fit 32 bits.");
+    }
+  }
+
+private:
+  // Keeps the offset index below 16 bits, and the loops above from overflowing
+  static constexpr int kMaxSearchRadius = 128;
+
+  // Sum of the scales of layers 0 to 2 relative to layer 0
+  static constexpr int kOffsetScale =
+      1 + DOWNSAMPLE_RATE + DOWNSAMPLE_RATE * DOWNSAMPLE_RATE;
+};
@@ -1,5 +1,10 @@
 #include "Burst.h"
 
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
 Halide::Runtime::Buffer<uint16_t> Burst::ToBuffer() const {
   if (Raws.empty()) {
     return Halide::Runtime::Buffer<uint16_t>();
@@ -14,18 +19,115 @@ Halide::Runtime::Buffer<uint16_t> Burst::ToBuffer() const {
   return result;
 }
 
+BurstMetadata Burst::GetMetadata() const {
+  return Raws.empty() ? BurstMetadata() : Raws[0].GetMetadata();
+}
+
 void Burst::CopyToBuffer(Halide::Runtime::Buffer<uint16_t> &buffer) const {
   buffer.copy_from(ToBuffer());
 }
 
 std::vector<RawImage> Burst::LoadRaws(const std::string &dirPath,
-                                      std::vector<std::string> &inputs) {
+                                      std::vector<std::string> &inputs,
+                                      bool use_mmap) {
+  // Every file is opened once. Its header is parsed on opening, so a burst
+  // whose frames do not match is rejected before any of them is decoded.
   std::vector<RawImage> result;
-  for (const auto &input : inputs) {
-    const std::string img_path = dirPath + "/" + input;
-    result.emplace_back(img_path);
+  if (!use_mmap) {
+    for (const auto &input : inputs) {
+      const std::string img_path = dirPath + "/" + input;
+      result.emplace_back(img_path, false);
+    }
+  } else {
+    // Mapping and advising every file up front lets the kernel read all
+    // frames ahead while the first ones are decoded.
+    std::vector<std::shared_ptr<MappedFile>> mappings;
+    for (const auto &input : inputs) {
+      mappings.push_back(std::make_shared<MappedFile>(dirPath + "/" + input));
+      mappings.back()->AdviseSequential();
+    }
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      result.emplace_back(dirPath + "/" + inputs[i], mappings[i], false);
+    }
+  }
+
+  std::vector<FrameInfo> frames;
+  for (const auto &raw : result) {
+    frames.push_back(raw.GetInfo());
+  }
+  const auto problems = CheckConsistency(frames);
+  if (!problems.empty()) {
+    for (const auto &problem : problems) {
+      std::cerr << problem << std::endl;
+    }
+    throw std::invalid_argument("Inconsistent burst");
+  }
+
+  for (auto &raw : result) {
+    raw.Decode();
   }
   return result;
 }
 
 const RawImage &Burst::GetRaw(const size_t i) const { return this->Raws[i]; }
+
+std::vector<FrameInfo> Burst::Probe(const std::string &dir_path,
+                                    const std::vector<std::string> &inputs) {
+  std::vector<FrameInfo> result;
+  for (const auto &input : inputs) {
+    result.push_back(RawImage::Probe(dir_path + "/" + input));
+  }
+  return result;
+}
+
+void Burst::DecodeFrame(const std::string &dir_path, const std::string &input,
+                        const FrameInfo &reference, bool use_mmap,
+                        Halide::Runtime::Buffer<uint16_t> &buffer) {
+  const std::string path = dir_path + "/" + input;
+  RawImage raw = use_mmap
+                     ? RawImage(path, std::make_shared<MappedFile>(path), false)
+                     : RawImage(path, false);
+  const auto problems = CheckConsistency({reference, raw.GetInfo()});
+  if (!problems.empty()) {
+    throw std::invalid_argument(problems.front());
+  }
+  raw.Decode();
+  raw.CopyToBuffer(buffer);
+}
+
+std::vector<std::string>
+Burst::CheckConsistency(const std::vector<FrameInfo> &frames) {
+  std::vector<std::string> problems;
+  if (frames.empty()) {
+    return problems;
+  }
+  const FrameInfo &reference = frames[0];
+  if (reference.cfa_pattern == CfaPattern::CFA_UNKNOWN) {
+    problems.push_back(reference.path + ": unsupported CFA pattern");
+  }
+
+  // Exposure values are stored with limited precision in some formats.
+  const auto differs = [](float a, float b) {
+    return std::abs(a - b) > 0.01f * std::max(std::abs(a), std::abs(b));
+  };
+  for (size_t i = 1; i < frames.size(); ++i) {
+    const FrameInfo &frame = frames[i];
+    if (frame.width != reference.width || frame.height != reference.height) {
+      problems.push_back(frame.path +
+                         ": size differs from the reference frame");
+    }
+    if (frame.cfa_pattern != reference.cfa_pattern) {
+      problems.push_back(frame.path +
+                         ": CFA pattern differs from the reference frame");
+    }
+    if (differs(frame.exposure_time, reference.exposure_time)) {
+      problems.push_back(frame.path +
+                         ": exposure time differs from the reference frame");
+    }
+    if (differs(frame.iso, reference.iso)) {
+      problems.push_back(frame.path +
+                         ": ISO differs from the reference frame");
+    }
+  }
+  return problems;
+}
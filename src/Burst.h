@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BurstMetadata.h"
 #include "InputSource.h"
 
 #include <Halide.h>
@@ -9,9 +10,12 @@
 
 class Burst {
 public:
-  Burst(std::string dir_path, std::vector<std::string> inputs)
+  // With use_mmap, all files are memory mapped and read ahead before the
+  // first one is decoded.
+  Burst(std::string dir_path, std::vector<std::string> inputs,
+        bool use_mmap = false)
       : Dir(std::move(dir_path)), Inputs(std::move(inputs)),
-        Raws(LoadRaws(Dir, Inputs)) {}
+        Raws(LoadRaws(Dir, Inputs, use_mmap)) {}
 
   ~Burst() = default;
 
@@ -41,12 +45,33 @@ public:
                         : Raws[0].GetColorCorrectionMatrix();
   }
 
+  // Metadata of the reference frame, as passed to HdrPlusContext
+  BurstMetadata GetMetadata() const;
+
   Halide::Runtime::Buffer<uint16_t> ToBuffer() const;
 
   void CopyToBuffer(Halide::Runtime::Buffer<uint16_t> &buffer) const;
 
   const RawImage &GetRaw(const size_t i) const;
 
+  // Reads the headers of all frames without decoding them.
+  static std::vector<FrameInfo> Probe(const std::string &dir_path,
+                                      const std::vector<std::string> &inputs);
+
+  // Returns a description of every way in which frames differ from the
+  // reference frame in size, CFA pattern, exposure time or ISO; empty if the
+  // burst is consistent.
+  static std::vector<std::string>
+  CheckConsistency(const std::vector<FrameInfo> &frames);
+
+  // Decodes one frame of a burst into 'buffer' without loading the others,
+  // for merging a burst as it is decoded. The header is checked against the
+  // reference frame first; throws std::invalid_argument if they differ.
+  static void DecodeFrame(const std::string &dir_path,
+                          const std::string &input,
+                          const FrameInfo &reference, bool use_mmap,
+                          Halide::Runtime::Buffer<uint16_t> &buffer);
+
 private:
   std::string Dir;
   std::vector<std::string> Inputs;
@@ -54,5 +79,6 @@ private:
 
 private:
   static std::vector<RawImage> LoadRaws(const std::string &dirPath,
-                                        std::vector<std::string> &inputs);
+                                        std::vector<std::string> &inputs,
+                                        bool use_mmap);
 };
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <array>
+
+#include "finish.h"
+
+/*
+ * BurstMetadata -- Camera parameters the pipeline needs besides the pixels of
+ * a burst. They describe the reference frame and are assumed to hold for the
+ * whole burst.
+ */
+struct BurstMetadata {
+  int black_level = 0;
+  int white_level = 65535;
+  WhiteBalance white_balance{1.f, 1.f, 1.f, 1.f};
+  CfaPattern cfa_pattern = CfaPattern::CFA_RGGB;
+  // Camera RGB to sRGB, row-major as LibRaw's rgb_cam
+  std::array<float, 9> color_correction = {1.f, 0.f, 0.f, 0.f, 1.f,
+                                           0.f, 0.f, 0.f, 1.f};
+};
@@ -0,0 +1,300 @@
+#include "BurstPyramid.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <coarse_residual_pipeline.h>
+#include <frame_pyramid.h>
+#include <frame_sharpness.h>
+
+#include "AlignParams.h"
+
+namespace {
+
+// Identifies the file format; bump the version when the layout of the file or
+// the output of frame_pyramid changes.
+constexpr char kMagic[8] = {'H', 'D', 'R', 'P', 'P', 'Y', 'R', '2'};
+
+// Ratio of the coarse residuals at zero offsets and after the alignment
+// search up to which a frame counts as static.
+constexpr float kStaticTolerance = 1.1f;
+
+// Median coarse residual below which frames are rejected as if it were this
+// high, in levels of the raw data. Otherwise a burst whose frames mostly match
+// the reference exactly, e.g. repeated frames, has a median of 0 and every
+// other frame is rejected.
+constexpr float kMinResidual = 1.f;
+
+// Grows 'buffer' to 'capacity' slots in its last dimension, keeping the
+// contents of the slots it had.
+void Grow(Halide::Runtime::Buffer<uint16_t> &buffer, int width, int height,
+          int capacity) {
+  Halide::Runtime::Buffer<uint16_t> grown(width, height, capacity);
+  if (buffer.data() != nullptr) {
+    grown.copy_from(buffer);
+  }
+  buffer = grown;
+}
+
+// The first 'frames' slots of a buffer allocated by Grow are contiguous.
+size_t SlotBytes(const Halide::Runtime::Buffer<uint16_t> &buffer, int frames) {
+  return size_t(buffer.width()) * buffer.height() * frames * sizeof(uint16_t);
+}
+
+template <typename T> void WriteValue(std::ofstream &file, const T &value) {
+  file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> bool ReadValue(std::ifstream &file, T &value) {
+  return bool(file.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+} // namespace
+
+BurstPyramid::BurstPyramid(int width, int height)
+    : Width(width), Height(height) {
+  if (width <= 0 || height <= 0) {
+    throw std::invalid_argument("The frames of a burst must not be empty.");
+  }
+}
+
+BurstPyramid::BurstPyramid(const Halide::Runtime::Buffer<uint16_t> &frames)
+    : BurstPyramid(frames.width(), frames.height()) {
+  if (frames.dimensions() != 3) {
+    throw std::invalid_argument(
+        "The frames of a burst must be a 3-dimensional buffer.");
+  }
+  Reserve(frames.extent(2));
+  for (int n = 0; n < frames.extent(2); n++) {
+    Append(frames.sliced(2, frames.dim(2).min() + n));
+  }
+}
+
+void BurstPyramid::Reserve(int capacity) {
+  if (Frames.data() != nullptr && capacity <= Frames.extent(2)) {
+    return;
+  }
+  Grow(Frames, Width, Height, capacity);
+  Grow(Layer0, Width / 2, Height / 2, capacity);
+  Grow(Layer1, Width / 2 / DOWNSAMPLE_RATE, Height / 2 / DOWNSAMPLE_RATE,
+       capacity);
+  Grow(Layer2, Width / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE,
+       Height / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE, capacity);
+}
+
+void BurstPyramid::Append(const Halide::Runtime::Buffer<uint16_t> &frame) {
+  if (frame.dimensions() != 2 || frame.width() != Width ||
+      frame.height() != Height) {
+    throw std::invalid_argument(
+        "Frames appended to a burst must match its frame size.");
+  }
+  if (Frames.data() == nullptr || NumFrames == Frames.extent(2)) {
+    Reserve(std::max(2, 2 * NumFrames));
+  }
+  Halide::Runtime::Buffer<uint16_t> slot = Frames.sliced(2, NumFrames);
+  slot.copy_from(frame);
+  Halide::Runtime::Buffer<uint16_t> layer_0 = Layer0.sliced(2, NumFrames);
+  Halide::Runtime::Buffer<uint16_t> layer_1 = Layer1.sliced(2, NumFrames);
+  Halide::Runtime::Buffer<uint16_t> layer_2 = Layer2.sliced(2, NumFrames);
+  frame_pyramid(slot, layer_0, layer_1, layer_2);
+  Rejected.push_back(false);
+  NumFrames++;
+}
+
+Halide::Runtime::Buffer<uint16_t> BurstPyramid::GetFrames() const {
+  return Frames.cropped(2, 0, NumFrames);
+}
+
+Halide::Runtime::Buffer<uint16_t> BurstPyramid::GetLayer0() const {
+  return Layer0.cropped(2, 0, NumFrames);
+}
+
+Halide::Runtime::Buffer<uint16_t> BurstPyramid::GetLayer1() const {
+  return Layer1.cropped(2, 0, NumFrames);
+}
+
+Halide::Runtime::Buffer<uint16_t> BurstPyramid::GetLayer2() const {
+  return Layer2.cropped(2, 0, NumFrames);
+}
+
+int BurstPyramid::SharpestFrame(int candidates) const {
+  const int count = std::min(candidates, NumFrames);
+  if (count < 1) {
+    throw std::invalid_argument(
+        "There are no frames to pick a reference from.");
+  }
+  Halide::Runtime::Buffer<uint16_t> layer = Layer1.cropped(2, 0, count);
+  Halide::Runtime::Buffer<float> sharpness(count);
+  frame_sharpness(layer, sharpness);
+  int sharpest = 0;
+  for (int n = 1; n < count; n++) {
+    if (sharpness(n) > sharpness(sharpest)) {
+      sharpest = n;
+    }
+  }
+  return sharpest;
+}
+
+void BurstPyramid::SetReference(int n) {
+  if (n < 0 || n >= NumFrames) {
+    throw std::invalid_argument("The reference must be a frame of the burst.");
+  }
+  Reference = n;
+  Rejected.assign(NumFrames, false);
+}
+
+void BurstPyramid::Residuals(std::vector<float> &aligned,
+                             std::vector<float> &unaligned) const {
+  aligned.assign(NumFrames, 0.f);
+  unaligned.assign(NumFrames, 0.f);
+  if (NumFrames < 2) {
+    return;
+  }
+  // All frames, reference first
+  Halide::Runtime::Buffer<int32_t> frame_map(NumFrames);
+  frame_map(0) = Reference;
+  for (int n = 0, i = 1; n < NumFrames; n++) {
+    if (n != Reference) {
+      frame_map(i++) = n;
+    }
+  }
+  Halide::Runtime::Buffer<uint16_t> layer = Layer2.cropped(2, 0, NumFrames);
+  Halide::Runtime::Buffer<float> residual(NumFrames);
+  Halide::Runtime::Buffer<float> residual_static(NumFrames);
+  coarse_residual_pipeline(layer, frame_map, residual, residual_static);
+  for (int i = 0; i < NumFrames; i++) {
+    aligned[frame_map(i)] = residual(i);
+    unaligned[frame_map(i)] = residual_static(i);
+  }
+}
+
+std::vector<float> BurstPyramid::CoarseResiduals() const {
+  std::vector<float> aligned, unaligned;
+  Residuals(aligned, unaligned);
+  return aligned;
+}
+
+bool BurstPyramid::IsStatic() const {
+  std::vector<float> aligned, unaligned;
+  Residuals(aligned, unaligned);
+  for (int n : GetFrameMap()) {
+    if (!IsStaticResidual(aligned[n], unaligned[n])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BurstPyramid::IsStaticResidual(float aligned, float unaligned) {
+  // At zero offsets, the residual of a static frame is noise alone, which the
+  // search cannot reduce by more than chance.
+  return unaligned <= kStaticTolerance * aligned;
+}
+
+float BurstPyramid::RejectionThreshold(std::vector<float> residuals,
+                                       float factor) {
+  if (factor < 1.f) {
+    throw std::invalid_argument(
+        "Frames can only be rejected above the median residual.");
+  }
+  if (residuals.empty()) {
+    return 0.f;
+  }
+  // The lower median, so that the frame holding it is never rejected.
+  auto median = residuals.begin() + (residuals.size() - 1) / 2;
+  std::nth_element(residuals.begin(), median, residuals.end());
+  return factor * std::max(*median, kMinResidual);
+}
+
+int BurstPyramid::RejectFrames(float factor) {
+  const std::vector<float> residuals = CoarseResiduals();
+  std::vector<float> alternates;
+  for (int n = 0; n < NumFrames; n++) {
+    if (n != Reference) {
+      alternates.push_back(residuals[n]);
+    }
+  }
+  const float threshold = RejectionThreshold(alternates, factor);
+
+  int rejected = 0;
+  for (int n = 0; n < NumFrames; n++) {
+    Rejected[n] = n != Reference && residuals[n] > threshold;
+    rejected += Rejected[n];
+  }
+  return rejected;
+}
+
+std::vector<int> BurstPyramid::GetFrameMap() const {
+  std::vector<int> frame_map = {Reference};
+  for (int n = 0; n < NumFrames; n++) {
+    if (n != Reference && !Rejected[n]) {
+      frame_map.push_back(n);
+    }
+  }
+  return frame_map;
+}
+
+void BurstPyramid::Save(const std::string &path,
+                        const BurstMetadata &metadata) const {
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    const int32_t header[3] = {Width, Height, NumFrames};
+    file.write(kMagic, sizeof(kMagic));
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    WriteValue(file, metadata.black_level);
+    WriteValue(file, metadata.white_level);
+    WriteValue(file, metadata.white_balance);
+    WriteValue(file, static_cast<int32_t>(metadata.cfa_pattern));
+    WriteValue(file, metadata.color_correction);
+    if (NumFrames > 0) {
+      for (const auto *buffer : {&Frames, &Layer0, &Layer1, &Layer2}) {
+        file.write(reinterpret_cast<const char *>(buffer->data()),
+                   SlotBytes(*buffer, NumFrames));
+      }
+    }
+    if (!file) {
+      throw std::runtime_error("Cannot write burst pyramid " + tmp_path);
+    }
+  }
+  // Readers see either the previous pyramid or the complete new one.
+  std::filesystem::rename(tmp_path, path);
+}
+
+BurstPyramid BurstPyramid::Load(const std::string &path,
+                                BurstMetadata &metadata) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(kMagic)];
+  int32_t header[3];
+  int32_t cfa_pattern;
+  BurstMetadata md;
+  if (!file.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+      !file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      header[0] <= 0 || header[1] <= 0 || header[2] < 0 ||
+      !ReadValue(file, md.black_level) || !ReadValue(file, md.white_level) ||
+      !ReadValue(file, md.white_balance) || !ReadValue(file, cfa_pattern) ||
+      !ReadValue(file, md.color_correction)) {
+    throw std::runtime_error(path + " is not a burst pyramid.");
+  }
+  md.cfa_pattern = static_cast<CfaPattern>(cfa_pattern);
+  BurstPyramid pyramid(header[0], header[1]);
+  if (header[2] > 0) {
+    pyramid.Reserve(header[2]);
+    for (auto *buffer : {&pyramid.Frames, &pyramid.Layer0, &pyramid.Layer1,
+                         &pyramid.Layer2}) {
+      if (!file.read(reinterpret_cast<char *>(buffer->data()),
+                     SlotBytes(*buffer, header[2]))) {
+        throw std::runtime_error(path + " is truncated.");
+      }
+    }
+  }
+  pyramid.NumFrames = header[2];
+  pyramid.Rejected.assign(header[2], false);
+  metadata = md;
+  return pyramid;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+#include "BurstMetadata.h"
+
+/*
+ * BurstPyramid -- The frames of a burst together with the alignment pyramid
+ * of every frame (layers 0 to 2, as built by align). The pyramids are
+ * computed once, by frame_pyramid, and are read by hdrplus_from_pyramid
+ * through HdrPlusContext::Process, so rendering the burst again does not
+ * rebuild them, and appending a frame computes the pyramid of that frame
+ * alone. A pyramid can be saved to disk together with the metadata of the
+ * burst and loaded back, e.g. to re-render a burst in a later run without
+ * decoding it (hdrplus --pyramid-cache); the file is written in the byte
+ * order of the host.
+ */
+class BurstPyramid {
+public:
+  // An empty burst of width x height frames.
+  BurstPyramid(int width, int height);
+
+  // The burst frames(x, y, n), with frame 0 as the reference.
+  explicit BurstPyramid(const Halide::Runtime::Buffer<uint16_t> &frames);
+
+  // Copies 'frame' to the end of the burst and computes its pyramid.
+  void Append(const Halide::Runtime::Buffer<uint16_t> &frame);
+
+  // Index of the sharpest of the first 'candidates' frames, measured by the
+  // gradient energy of their layer 1 (frame_sharpness).
+  int SharpestFrame(int candidates) const;
+
+  // Makes frame n the reference of the burst, without moving any frame. The
+  // other frames keep their order. Rejected frames are merged again.
+  void SetReference(int n);
+
+  int GetReference() const { return Reference; }
+
+  // Mean absolute difference per pixel between every frame and the reference
+  // after aligning layer 2 of their pyramids (coarse_residual_pipeline). The
+  // reference has a residual of 0.
+  std::vector<float> CoarseResiduals() const;
+
+  // Whether the scene of the burst is static: for none of the frames that are
+  // merged does the alignment search on layer 2 improve noticeably on zero
+  // offsets. A static burst can be rendered with ProcessOptions::assume_static.
+  bool IsStatic() const;
+
+  // Whether a frame whose coarse residual is 'aligned' after the alignment
+  // search and 'unaligned' at zero offsets counts as static.
+  static bool IsStaticResidual(float aligned, float unaligned);
+
+  // Leaves out of the merge the frames whose coarse residual exceeds 'factor'
+  // (at least 1) times the median residual of the frames other than the
+  // reference, so that they cost nothing at full resolution. Returns the
+  // number of frames rejected; at least one frame besides the reference is
+  // always kept.
+  int RejectFrames(float factor);
+
+  // Coarse residual above which RejectFrames rejects a frame, given those of
+  // the frames other than the reference: 'factor' times their lower median,
+  // which is floored at a small residual so that a burst of identical frames
+  // keeps its frames. Throws std::invalid_argument if 'factor' is below 1.
+  static float RejectionThreshold(std::vector<float> residuals, float factor);
+
+  // Frames of the burst in the order they are merged in, reference first, as
+  // the frame_map of hdrplus_from_pyramid. Rejected frames are left out.
+  std::vector<int> GetFrameMap() const;
+
+  // Neither the reference nor rejections are saved; a loaded pyramid has
+  // frame 0 as reference and merges all frames. A previous file at 'path' is
+  // replaced atomically.
+  void Save(const std::string &path, const BurstMetadata &metadata) const;
+
+  // Throws std::runtime_error if 'path' does not hold a pyramid saved in the
+  // current format.
+  static BurstPyramid Load(const std::string &path, BurstMetadata &metadata);
+
+  int GetWidth() const { return Width; }
+
+  int GetHeight() const { return Height; }
+
+  int GetNumFrames() const { return NumFrames; }
+
+  // Frames and layers of the burst, indexed by frame in the last dimension
+  Halide::Runtime::Buffer<uint16_t> GetFrames() const;
+
+  Halide::Runtime::Buffer<uint16_t> GetLayer0() const;
+
+  Halide::Runtime::Buffer<uint16_t> GetLayer1() const;
+
+  Halide::Runtime::Buffer<uint16_t> GetLayer2() const;
+
+private:
+  // Coarse residuals of all frames, after alignment and at zero offsets
+  void Residuals(std::vector<float> &aligned,
+                 std::vector<float> &unaligned) const;
+
+  // Grows the buffers to hold at least 'capacity' frames, keeping the frames
+  // held so far.
+  void Reserve(int capacity);
+
+  int Width;
+  int Height;
+  int NumFrames = 0;
+  int Reference = 0;
+  std::vector<bool> Rejected; // by frame
+
+  // Allocated for a capacity of frames that grows geometrically, so that
+  // appending copies the burst only occasionally.
+  Halide::Runtime::Buffer<uint16_t> Frames;
+  Halide::Runtime::Buffer<uint16_t> Layer0;
+  Halide::Runtime::Buffer<uint16_t> Layer1;
+  Halide::Runtime::Buffer<uint16_t> Layer2;
+};
@@ -0,0 +1,633 @@
+#include "HdrPlusContext.h"
+
+#include <algorithm>
+#include <future>
+#include <stdexcept>
+#include <string>
+
+#include <HalideRuntime.h>
+
+#include <align_and_merge.h>
+#include <coarse_residual_frames.h>
+#include <finish_pipeline.h>
+#include <finish_prefix_pipeline.h>
+#include <finish_tone_pipeline.h>
+#include <frame_sharpness_frames.h>
+#include <hdrplus_from_pyramid.h>
+#include <hdrplus_from_pyramid_static.h>
+#include <hdrplus_from_pyramid_u8.h>
+#include <hdrplus_pipeline.h>
+#include <hdrplus_pipeline_static.h>
+#include <hdrplus_pipeline_u8.h>
+#include <hdrplus_preview.h>
+
+#include "BurstPyramid.h"
+#include "ParallelFor.h"
+#include "StreamingMerger.h"
+#include "ZslRingBuffer.h"
+
+namespace {
+
+// Frames merged from a burst of 'num_frames' frames, as the frame_map of
+// hdrplus_pipeline: ProcessOptions::frame_map, or all frames in order.
+Halide::Runtime::Buffer<int32_t> MakeFrameMap(const std::vector<int> &frames,
+                                              int num_frames) {
+  if (frames.empty()) {
+    Halide::Runtime::Buffer<int32_t> frame_map(num_frames);
+    for (int i = 0; i < num_frames; i++) {
+      frame_map(i) = i;
+    }
+    return frame_map;
+  }
+  if (frames.size() < 2) {
+    throw std::invalid_argument("A burst needs at least two frames.");
+  }
+  Halide::Runtime::Buffer<int32_t> frame_map(static_cast<int>(frames.size()));
+  for (size_t i = 0; i < frames.size(); i++) {
+    if (frames[i] < 0 || frames[i] >= num_frames) {
+      throw std::invalid_argument(
+          "The frame map must only hold frames of the burst.");
+    }
+    frame_map(static_cast<int>(i)) = frames[i];
+  }
+  return frame_map;
+}
+
+} // namespace
+
+HdrPlusContext::HdrPlusContext(int num_threads, bool use_huge_pages)
+    : Pool(use_huge_pages) {
+  Pool.Install();
+  if (num_threads > 0) {
+    halide_set_num_threads(num_threads);
+  }
+}
+
+HdrPlusContext::~HdrPlusContext() { Pool.Uninstall(); }
+
+void HdrPlusContext::StartBurst(int width, int height) {
+  if (width != FrameWidth || height != FrameHeight) {
+    Pool.Trim();
+    FrameWidth = width;
+    FrameHeight = height;
+  }
+}
+
+ImageRegion
+HdrPlusContext::GetOutputRegion(int width, int height,
+                                const ProcessOptions &options) const {
+  width /= options.downsample;
+  height /= options.downsample;
+  if (!options.roi) {
+    return {0, 0, width, height};
+  }
+  const ImageRegion &roi = *options.roi;
+  if (options.downsample > 1) {
+    throw std::invalid_argument(
+        "A region of interest cannot be combined with a preview.");
+  }
+  // The pipelines blend tiles that overlap by half a tile
+  const int minimum = GetAlignParams(options).tile_size_2();
+  if (roi.x < 0 || roi.y < 0 || roi.width < minimum ||
+      roi.height < minimum || roi.x + roi.width > width ||
+      roi.y + roi.height > height) {
+    throw std::invalid_argument(
+        "The region of interest must lie within the frame and be at least " +
+        std::to_string(minimum) + "x" + std::to_string(minimum) +
+        " pixels.");
+  }
+  return roi;
+}
+
+AlignParams HdrPlusContext::GetAlignParams(const ProcessOptions &options) {
+  AlignParams params;
+  params.coarse_u8 = options.coarse_u8;
+  return params;
+}
+
+int HdrPlusContext::BandRows(int width, int height, int frames,
+                             size_t memory_budget, PipelineKind kind,
+                             const AlignParams &params) {
+  params.Validate();
+  const int tile = params.tile_size;
+  const size_t minimum =
+      EstimatePipelineMemory(kind, width, height, frames, tile, params);
+  if (minimum > memory_budget) {
+    throw std::invalid_argument(
+        "The memory budget is too small to render a band of " +
+        std::to_string(tile) + " rows, which needs " +
+        std::to_string(minimum / (1024 * 1024) + 1) + " MiB.");
+  }
+  int lo = 1;
+  int hi = (height + tile - 1) / tile;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (EstimatePipelineMemory(kind, width, height, frames, mid * tile,
+                               params) <= memory_budget) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo * tile;
+}
+
+Halide::Runtime::Buffer<float>
+HdrPlusContext::GetColorCorrectionMatrix(const BurstMetadata &metadata) {
+  std::lock_guard<std::mutex> lock(CcmMutex);
+  auto it = std::find_if(CcmCache.begin(), CcmCache.end(),
+                         [&](const auto &entry) {
+                           return entry.first == metadata.color_correction;
+                         });
+  if (it != CcmCache.end()) {
+    CcmCache.splice(CcmCache.begin(), CcmCache, it);
+    return CcmCache.front().second;
+  }
+  Halide::Runtime::Buffer<float> ccm(3, 3);
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      ccm(i, j) = metadata.color_correction[j * 3 + i];
+    }
+  }
+  CcmCache.emplace_front(metadata.color_correction, ccm);
+  if (CcmCache.size() > kCcmCacheSize) {
+    CcmCache.pop_back();
+  }
+  return ccm;
+}
+
+/*
+ * Render -- Halide bounds inference restricts every stage to the tiles needed
+ * for the requested rectangle, which is rendered exactly as in a full render.
+ * With a memory budget the output is rendered in horizontal bands, each of
+ * them computing only its own rows plus the halo its stencils and alignment
+ * tiles require, which gives a result identical to rendering in one pass.
+ */
+void HdrPlusContext::Render(const Halide::Runtime::Buffer<uint16_t> &frames,
+                            const BurstMetadata &metadata,
+                            const ProcessOptions &options,
+                            const BandSource &band_source,
+                            const RowConsumer &consume) {
+  if (frames.dimensions() != 3 || frames.extent(2) < 2) {
+    throw std::invalid_argument(
+        "The input of HDRPlus must be a 3-dimensional buffer with at least "
+        "two channels.");
+  }
+  const ImageRegion region =
+      GetOutputRegion(frames.width(), frames.height(), options);
+  StartBurst(frames.width(), frames.height());
+
+  // The generated pipelines take non-const buffers; these share the memory of
+  // the caller.
+  Halide::Runtime::Buffer<uint16_t> imgs = frames;
+  Halide::Runtime::Buffer<int32_t> frame_map =
+      MakeFrameMap(options.frame_map, frames.extent(2));
+  const int count = frame_map.width();
+  Halide::Runtime::Buffer<float> ccm = GetColorCorrectionMatrix(metadata);
+  const WhiteBalance &wb = metadata.white_balance;
+  const int cfa_pattern = static_cast<int>(metadata.cfa_pattern);
+  const uint16_t black_level = metadata.black_level;
+  const uint16_t white_level = metadata.white_level;
+
+  if (options.downsample > 1) {
+    if (!options.frame_map.empty()) {
+      throw std::invalid_argument(
+          "Previews merge all frames with frame 0 as the reference.");
+    }
+    Halide::Runtime::Buffer<uint8_t> output = band_source(0, region.height);
+    hdrplus_preview(imgs, black_level, white_level, wb.r, wb.g0, wb.g1, wb.b,
+                    cfa_pattern, ccm, options.compression, options.gain,
+                    options.downsample, output);
+    if (consume) {
+      consume(output);
+    }
+    return;
+  }
+
+  int rows = region.height;
+  if (options.memory_budget > 0) {
+    rows = std::min(rows, BandRows(frames.width(), frames.height(), count,
+                                   options.memory_budget,
+                                   PipelineKind::HDR_PLUS,
+                                   GetAlignParams(options)));
+  }
+
+  const auto render = options.assume_static ? hdrplus_pipeline_static
+                      : options.coarse_u8   ? hdrplus_pipeline_u8
+                                            : hdrplus_pipeline;
+  const auto pipeline = [&](Halide::Runtime::Buffer<uint8_t> &band) {
+    render(imgs, frame_map, black_level, white_level, wb.r, wb.g0, wb.g1,
+           wb.b, cfa_pattern, ccm, options.compression, options.gain, band);
+  };
+  RenderBands(region, rows, band_source, pipeline, consume);
+}
+
+void HdrPlusContext::RenderPyramid(
+    const Halide::Runtime::Buffer<uint16_t> &frames,
+    const Halide::Runtime::Buffer<uint16_t> &layer_0,
+    const Halide::Runtime::Buffer<uint16_t> &layer_1,
+    const Halide::Runtime::Buffer<uint16_t> &layer_2,
+    const std::vector<int> &slots, const BurstMetadata &metadata,
+    const ProcessOptions &options, const BandSource &band_source,
+    const RowConsumer &consume) {
+  if (slots.size() < 2) {
+    throw std::invalid_argument("A burst needs at least two frames.");
+  }
+  if (options.downsample > 1) {
+    throw std::invalid_argument(
+        "Previews of a burst with precomputed pyramids are not supported.");
+  }
+  if (!options.frame_map.empty()) {
+    throw std::invalid_argument(
+        "A burst with precomputed pyramids chooses its frames itself.");
+  }
+  const ImageRegion region =
+      GetOutputRegion(frames.width(), frames.height(), options);
+  StartBurst(frames.width(), frames.height());
+
+  Halide::Runtime::Buffer<uint16_t> imgs = frames;
+  Halide::Runtime::Buffer<uint16_t> layers[3] = {layer_0, layer_1, layer_2};
+  const int count = static_cast<int>(slots.size());
+  Halide::Runtime::Buffer<int32_t> frame_map(count);
+  for (int i = 0; i < count; i++) {
+    frame_map(i) = slots[i];
+  }
+  Halide::Runtime::Buffer<float> ccm = GetColorCorrectionMatrix(metadata);
+  const WhiteBalance &wb = metadata.white_balance;
+  const int cfa_pattern = static_cast<int>(metadata.cfa_pattern);
+  const uint16_t black_level = metadata.black_level;
+  const uint16_t white_level = metadata.white_level;
+
+  int rows = region.height;
+  if (options.memory_budget > 0) {
+    rows = std::min(rows, BandRows(frames.width(), frames.height(), count,
+                                   options.memory_budget,
+                                   PipelineKind::HDR_PLUS,
+                                   GetAlignParams(options)));
+  }
+
+  const auto render = options.assume_static ? hdrplus_from_pyramid_static
+                      : options.coarse_u8   ? hdrplus_from_pyramid_u8
+                                            : hdrplus_from_pyramid;
+  const auto pipeline = [&](Halide::Runtime::Buffer<uint8_t> &band) {
+    render(imgs, layers[0], layers[1], layers[2], frame_map, black_level,
+           white_level, wb.r, wb.g0, wb.g1, wb.b, cfa_pattern, ccm,
+           options.compression, options.gain, band);
+  };
+  RenderBands(region, rows, band_source, pipeline, consume);
+}
+
+void HdrPlusContext::RenderFinish(
+    const Halide::Runtime::Buffer<uint16_t> &merged,
+    const BurstMetadata &metadata, const ProcessOptions &options,
+    const BandSource &band_source, const RowConsumer &consume) {
+  if (merged.dimensions() != 2) {
+    throw std::invalid_argument(
+        "The input of finish must be a 2-dimensional merged bayer frame.");
+  }
+  if (options.downsample > 1) {
+    throw std::invalid_argument(
+        "Previews of a merged frame are not supported.");
+  }
+  const ImageRegion region =
+      GetOutputRegion(merged.width(), merged.height(), options);
+  StartBurst(merged.width(), merged.height());
+
+  Halide::Runtime::Buffer<uint16_t> input = merged;
+  Halide::Runtime::Buffer<float> ccm = GetColorCorrectionMatrix(metadata);
+  const WhiteBalance &wb = metadata.white_balance;
+  const int cfa_pattern = static_cast<int>(metadata.cfa_pattern);
+  const uint16_t black_level = metadata.black_level;
+  const uint16_t white_level = metadata.white_level;
+
+  int rows = region.height;
+  if (options.memory_budget > 0) {
+    rows = std::min(rows, BandRows(merged.width(), merged.height(), 1,
+                                   options.memory_budget, PipelineKind::FINISH,
+                                   GetAlignParams(options)));
+  }
+
+  const auto pipeline = [&](Halide::Runtime::Buffer<uint8_t> &band) {
+    finish_pipeline(input, black_level, white_level, wb.r, wb.g0, wb.g1, wb.b,
+                    cfa_pattern, ccm, options.compression, options.gain, band);
+  };
+  RenderBands(region, rows, band_source, pipeline, consume);
+}
+
+void HdrPlusContext::RenderBands(const ImageRegion &region, int rows,
+                                 const BandSource &band_source,
+                                 const BandPipeline &pipeline,
+                                 const RowConsumer &consume) {
+  const int y_end = region.y + region.height;
+  for (int y = region.y; y < y_end; y += rows) {
+    Halide::Runtime::Buffer<uint8_t> band =
+        band_source(y, std::min(rows, y_end - y));
+    pipeline(band);
+    if (consume) {
+      consume(band);
+    }
+  }
+}
+
+HdrPlusContext::BandSource
+HdrPlusContext::SharedBands(const ImageRegion &region) {
+  Halide::Runtime::Buffer<uint8_t> band_img;
+  return [region, band_img](int y, int rows) mutable {
+    if (band_img.data() == nullptr) {
+      band_img = Halide::Runtime::Buffer<uint8_t>(3, region.width, rows);
+    }
+    auto band = band_img.cropped(2, 0, rows);
+    band.set_min(0, region.x, y);
+    return band;
+  };
+}
+
+HdrPlusContext::BandSource
+HdrPlusContext::OutputBands(const ImageRegion &region,
+                            Halide::Runtime::Buffer<uint8_t> &output) {
+  if (output.dimensions() != 3 || output.dim(0).extent() != 3 ||
+      output.dim(1).extent() != region.width ||
+      output.dim(2).extent() != region.height) {
+    throw std::invalid_argument(
+        "The output buffer does not match the output region.");
+  }
+  // A crop of the output shares its memory, so each band is written in place.
+  Halide::Runtime::Buffer<uint8_t> target = output;
+  target.set_min(0, region.x, region.y);
+  return [target](int y, int rows) { return target.cropped(2, y, rows); };
+}
+
+void HdrPlusContext::Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+                             const BurstMetadata &metadata,
+                             const ProcessOptions &options,
+                             const RowConsumer &consume) {
+  const ImageRegion region =
+      GetOutputRegion(frames.width(), frames.height(), options);
+  Render(frames, metadata, options, SharedBands(region), consume);
+}
+
+void HdrPlusContext::Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+                             const BurstMetadata &metadata,
+                             const ProcessOptions &options,
+                             Halide::Runtime::Buffer<uint8_t> &output) {
+  const ImageRegion region =
+      GetOutputRegion(frames.width(), frames.height(), options);
+  Render(frames, metadata, options, OutputBands(region, output), nullptr);
+}
+
+Halide::Runtime::Buffer<uint8_t>
+HdrPlusContext::Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+                        const BurstMetadata &metadata,
+                        const ProcessOptions &options) {
+  const ImageRegion region =
+      GetOutputRegion(frames.width(), frames.height(), options);
+  Halide::Runtime::Buffer<uint8_t> output(3, region.width, region.height);
+  Process(frames, metadata, options, output);
+  return output;
+}
+
+void HdrPlusContext::Process(const ZslRingBuffer &ring, int count,
+                             const BurstMetadata &metadata,
+                             const ProcessOptions &options,
+                             const RowConsumer &consume) {
+  const ImageRegion region =
+      GetOutputRegion(ring.GetWidth(), ring.GetHeight(), options);
+  RenderPyramid(ring.GetFrames(), ring.GetLayer0(), ring.GetLayer1(),
+                ring.GetLayer2(), ring.GetFrameMap(count), metadata, options,
+                SharedBands(region), consume);
+}
+
+Halide::Runtime::Buffer<uint8_t>
+HdrPlusContext::Process(const ZslRingBuffer &ring, int count,
+                        const BurstMetadata &metadata,
+                        const ProcessOptions &options) {
+  const ImageRegion region =
+      GetOutputRegion(ring.GetWidth(), ring.GetHeight(), options);
+  Halide::Runtime::Buffer<uint8_t> output(3, region.width, region.height);
+  RenderPyramid(ring.GetFrames(), ring.GetLayer0(), ring.GetLayer1(),
+                ring.GetLayer2(), ring.GetFrameMap(count), metadata, options,
+                OutputBands(region, output), nullptr);
+  return output;
+}
+
+void HdrPlusContext::Process(const BurstPyramid &pyramid,
+                             const BurstMetadata &metadata,
+                             const ProcessOptions &options,
+                             const RowConsumer &consume) {
+  const ImageRegion region =
+      GetOutputRegion(pyramid.GetWidth(), pyramid.GetHeight(), options);
+  RenderPyramid(pyramid.GetFrames(), pyramid.GetLayer0(), pyramid.GetLayer1(),
+                pyramid.GetLayer2(), pyramid.GetFrameMap(), metadata,
+                options, SharedBands(region), consume);
+}
+
+Halide::Runtime::Buffer<uint8_t>
+HdrPlusContext::Process(const BurstPyramid &pyramid,
+                        const BurstMetadata &metadata,
+                        const ProcessOptions &options) {
+  const ImageRegion region =
+      GetOutputRegion(pyramid.GetWidth(), pyramid.GetHeight(), options);
+  Halide::Runtime::Buffer<uint8_t> output(3, region.width, region.height);
+  RenderPyramid(pyramid.GetFrames(), pyramid.GetLayer0(), pyramid.GetLayer1(),
+                pyramid.GetLayer2(), pyramid.GetFrameMap(), metadata,
+                options, OutputBands(region, output), nullptr);
+  return output;
+}
+
+int HdrPlusContext::SharpestFrame(
+    const Halide::Runtime::Buffer<uint16_t> &frames, int candidates) {
+  if (frames.dimensions() != 3 || candidates < 1) {
+    throw std::invalid_argument(
+        "There are no frames to pick a reference from.");
+  }
+  StartBurst(frames.width(), frames.height());
+  const int count = std::min(candidates, frames.extent(2));
+  Halide::Runtime::Buffer<uint16_t> imgs =
+      frames.cropped(2, frames.dim(2).min(), count);
+  Halide::Runtime::Buffer<float> sharpness(count);
+  frame_sharpness_frames(imgs, sharpness);
+  int sharpest = 0;
+  for (int n = 1; n < count; n++) {
+    if (sharpness(n) > sharpness(sharpest)) {
+      sharpest = n;
+    }
+  }
+  return sharpest;
+}
+
+std::vector<int>
+HdrPlusContext::RejectFrames(const Halide::Runtime::Buffer<uint16_t> &frames,
+                             const std::vector<int> &frame_map,
+                             float factor) {
+  std::vector<float> aligned, unaligned;
+  CoarseResiduals(frames, frame_map, aligned, unaligned);
+  const float threshold = BurstPyramid::RejectionThreshold(
+      std::vector<float>(aligned.begin() + 1, aligned.end()), factor);
+  Halide::Runtime::Buffer<int32_t> frame_ids =
+      MakeFrameMap(frame_map, frames.extent(2));
+  std::vector<int> kept = {frame_ids(0)};
+  for (int i = 1; i < frame_ids.width(); i++) {
+    if (aligned[i] <= threshold) {
+      kept.push_back(frame_ids(i));
+    }
+  }
+  return kept;
+}
+
+bool HdrPlusContext::IsStatic(const Halide::Runtime::Buffer<uint16_t> &frames,
+                              const std::vector<int> &frame_map) {
+  std::vector<float> aligned, unaligned;
+  CoarseResiduals(frames, frame_map, aligned, unaligned);
+  for (size_t i = 1; i < aligned.size(); i++) {
+    if (!BurstPyramid::IsStaticResidual(aligned[i], unaligned[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void HdrPlusContext::CoarseResiduals(
+    const Halide::Runtime::Buffer<uint16_t> &frames,
+    const std::vector<int> &frame_map, std::vector<float> &aligned,
+    std::vector<float> &unaligned) {
+  if (frames.dimensions() != 3 || frames.extent(2) < 2) {
+    throw std::invalid_argument(
+        "Residuals are computed for bursts of at least two frames.");
+  }
+  StartBurst(frames.width(), frames.height());
+  Halide::Runtime::Buffer<uint16_t> imgs = frames;
+  Halide::Runtime::Buffer<int32_t> frame_ids =
+      MakeFrameMap(frame_map, frames.extent(2));
+  const int count = frame_ids.width();
+  Halide::Runtime::Buffer<float> residual(count);
+  Halide::Runtime::Buffer<float> residual_static(count);
+  coarse_residual_frames(imgs, frame_ids, residual, residual_static);
+  aligned.assign(residual.data(), residual.data() + count);
+  unaligned.assign(residual_static.data(), residual_static.data() + count);
+}
+
+void HdrPlusContext::AlignAndMerge(
+    const Halide::Runtime::Buffer<uint16_t> &frames,
+    Halide::Runtime::Buffer<uint16_t> &merged) {
+  if (frames.dimensions() != 3 || frames.extent(2) < 2) {
+    throw std::invalid_argument(
+        "The input of align and merge must be a 3-dimensional buffer with at "
+        "least two channels.");
+  }
+  StartBurst(frames.width(), frames.height());
+  Halide::Runtime::Buffer<uint16_t> imgs = frames;
+  align_and_merge(imgs, merged);
+}
+
+Halide::Runtime::Buffer<uint16_t>
+HdrPlusContext::AlignAndMerge(const Halide::Runtime::Buffer<uint16_t> &frames) {
+  Halide::Runtime::Buffer<uint16_t> merged(frames.width(), frames.height());
+  AlignAndMerge(frames, merged);
+  return merged;
+}
+
+Halide::Runtime::Buffer<uint16_t>
+HdrPlusContext::AlignAndMerge(int width, int height, int num_frames,
+                              const FrameSource &source) {
+  if (num_frames < 2) {
+    throw std::invalid_argument("A burst needs at least two frames.");
+  }
+  StartBurst(width, height);
+  // The source fills one buffer while the frame in the other is merged. The
+  // reference is no longer read once the merger is set up, so its buffer
+  // takes the third frame.
+  Halide::Runtime::Buffer<uint16_t> buffers[2] = {
+      Halide::Runtime::Buffer<uint16_t>(width, height),
+      Halide::Runtime::Buffer<uint16_t>(width, height)};
+  const auto produce = [&](int n) {
+    return std::async(std::launch::async,
+                      [&source, &buffers, n] { source(n, buffers[n % 2]); });
+  };
+
+  source(0, buffers[0]);
+  std::future<void> next = produce(1);
+  StreamingMerger merger(buffers[0]);
+  for (int n = 1; n < num_frames; n++) {
+    next.get();
+    if (n + 1 < num_frames) {
+      next = produce(n + 1);
+    }
+    merger.Push(buffers[n % 2]);
+  }
+  return merger.Finalize();
+}
+
+void HdrPlusContext::Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+                            const BurstMetadata &metadata,
+                            const ProcessOptions &options,
+                            const RowConsumer &consume) {
+  const ImageRegion region =
+      GetOutputRegion(merged.width(), merged.height(), options);
+  RenderFinish(merged, metadata, options, SharedBands(region), consume);
+}
+
+void HdrPlusContext::Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+                            const BurstMetadata &metadata,
+                            const ProcessOptions &options,
+                            Halide::Runtime::Buffer<uint8_t> &output) {
+  const ImageRegion region =
+      GetOutputRegion(merged.width(), merged.height(), options);
+  RenderFinish(merged, metadata, options, OutputBands(region, output),
+               nullptr);
+}
+
+Halide::Runtime::Buffer<uint8_t>
+HdrPlusContext::Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+                       const BurstMetadata &metadata,
+                       const ProcessOptions &options) {
+  const ImageRegion region =
+      GetOutputRegion(merged.width(), merged.height(), options);
+  Halide::Runtime::Buffer<uint8_t> output(3, region.width, region.height);
+  Finish(merged, metadata, options, output);
+  return output;
+}
+
+void HdrPlusContext::Sweep(const Halide::Runtime::Buffer<uint16_t> &merged,
+                           const BurstMetadata &metadata,
+                           const std::vector<ToneParams> &params,
+                           const SweepConsumer &consume, int concurrency) {
+  if (merged.dimensions() != 2) {
+    throw std::invalid_argument(
+        "The input of a sweep must be a 2-dimensional merged bayer frame.");
+  }
+  if (concurrency < 1) {
+    throw std::invalid_argument(
+        "The concurrency of a sweep must be positive.");
+  }
+  const int width = merged.width();
+  const int height = merged.height();
+  StartBurst(width, height);
+
+  Halide::Runtime::Buffer<uint16_t> input = merged;
+  Halide::Runtime::Buffer<float> ccm = GetColorCorrectionMatrix(metadata);
+  const WhiteBalance &wb = metadata.white_balance;
+  Halide::Runtime::Buffer<uint16_t> srgb(width, height, 3);
+  finish_prefix_pipeline(input, metadata.black_level, metadata.white_level,
+                         wb.r, wb.g0, wb.g1, wb.b,
+                         static_cast<int>(metadata.cfa_pattern), ccm, srgb);
+
+  // One output per pair in flight, reused by the following pairs
+  std::vector<Halide::Runtime::Buffer<uint8_t>> images(
+      std::min<size_t>(concurrency, params.size()));
+  for (auto &image : images) {
+    image = Halide::Runtime::Buffer<uint8_t>(3, width, height);
+  }
+
+  for (size_t first = 0; first < params.size(); first += images.size()) {
+    const int count = std::min(images.size(), params.size() - first);
+    ParallelFor(count, [&](int i) {
+      const ToneParams &tone = params[first + i];
+      finish_tone_pipeline(srgb, tone.compression, tone.gain, images[i]);
+    });
+    if (consume) {
+      for (int i = 0; i < count; ++i) {
+        consume(first + i, images[i]);
+      }
+    }
+  }
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+#include "AlignParams.h"
+#include "BurstMetadata.h"
+#include "MemoryEstimate.h"
+#include "MemoryPool.h"
+
+class BurstPyramid;
+class ZslRingBuffer;
+
+// Rectangle of an output image, in pixels of the full resolution frame
+struct ImageRegion {
+  int x, y, width, height;
+};
+
+struct ProcessOptions {
+  Compression compression = 3.8f;
+  Gain gain = 1.1f;
+  // Reduction of the output resolution for previews; 1 for a full render
+  int downsample = 1;
+  // Rectangle of the full resolution output to render, at least half an
+  // alignment tile (AlignParams::tile_size_2) on each side; the whole frame if
+  // unset
+  std::optional<ImageRegion> roi;
+  // Bound on the memory used by pipeline intermediates in bytes; 0 to render
+  // the whole output in one pass
+  size_t memory_budget = 0;
+  // Merges with zero alignment offsets, skipping the alignment search, for
+  // bursts of a static scene such as tripod shots. Previews align coarsely
+  // either way. See BurstPyramid::IsStatic for detecting static bursts.
+  bool assume_static = false;
+  // Searches layers 1 and 2 of the alignment pyramid on 8-bit copies of them
+  // (AlignParams::coarse_u8), which is faster and rarely changes the offsets.
+  // Has no effect with assume_static or on previews.
+  bool coarse_u8 = false;
+  // Frames of a burst passed as frames(x, y, n) in the order they are merged
+  // in, reference first; frames left out are not merged. Empty to merge all
+  // frames with frame 0 as the reference. The frames are not moved, so
+  // choosing another reference or leaving out frames costs no copy. Not
+  // supported on previews or bursts with precomputed pyramids.
+  std::vector<int> frame_map;
+};
+
+// Tone mapping parameters of one output of a sweep
+struct ToneParams {
+  Compression compression;
+  Gain gain;
+};
+
+/*
+ * HdrPlusContext -- Entry point for embedding the pipeline. A context is meant
+ * to live across many bursts: it owns the memory pool serving the Halide
+ * intermediates, sizes the Halide thread pool once and caches per-camera
+ * tables such as the color correction matrix buffer, so consecutive calls pay
+ * no setup cost. The pool caches the blocks of one frame size at a time and is
+ * trimmed when a burst of another size arrives. Bursts are passed in memory as
+ * buffers indexed as frames(x, y, n), with frame 0 as the reference, and are
+ * read in place.
+ *
+ * The pool is installed for all pipelines of the process, so only one context
+ * should exist at a time.
+ */
+class HdrPlusContext {
+public:
+  // Receives the rows of the output in bands, from top to bottom, indexed as
+  // rows(c, x, y).
+  using RowConsumer =
+      std::function<void(const Halide::Runtime::Buffer<uint8_t> &rows)>;
+
+  // Receives the output rendered with params[index] of a sweep, indexed as
+  // image(c, x, y).
+  using SweepConsumer = std::function<void(
+      size_t index, const Halide::Runtime::Buffer<uint8_t> &image)>;
+
+  // Writes frame n of a burst into 'frame', a width x height buffer, for a
+  // streaming merge. Called on a worker thread, one frame at a time.
+  using FrameSource =
+      std::function<void(int n, Halide::Runtime::Buffer<uint16_t> &frame)>;
+
+  // A num_threads of 0 keeps the Halide default of one thread per core.
+  explicit HdrPlusContext(int num_threads = 0, bool use_huge_pages = false);
+
+  ~HdrPlusContext();
+
+  HdrPlusContext(const HdrPlusContext &) = delete;
+  HdrPlusContext &operator=(const HdrPlusContext &) = delete;
+
+  // Rectangle of the output that Process renders for a width x height burst.
+  ImageRegion GetOutputRegion(int width, int height,
+                              const ProcessOptions &options) const;
+
+  // Renders the burst and hands the output to 'consume' band by band as it is
+  // produced, so only one band of output is held in memory.
+  void Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+               const BurstMetadata &metadata, const ProcessOptions &options,
+               const RowConsumer &consume);
+
+  // Renders the burst into 'output', which must cover GetOutputRegion.
+  void Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+               const BurstMetadata &metadata, const ProcessOptions &options,
+               Halide::Runtime::Buffer<uint8_t> &output);
+
+  Halide::Runtime::Buffer<uint8_t>
+  Process(const Halide::Runtime::Buffer<uint16_t> &frames,
+          const BurstMetadata &metadata, const ProcessOptions &options = {});
+
+  // Renders a burst of the 'count' most recent frames of a ring buffer, with
+  // the newest frame as the reference. Their alignment pyramids were computed
+  // as the frames arrived, so only the alignment search, the merge and finish
+  // run. Previews are not supported.
+  void Process(const ZslRingBuffer &ring, int count,
+               const BurstMetadata &metadata, const ProcessOptions &options,
+               const RowConsumer &consume);
+
+  Halide::Runtime::Buffer<uint8_t>
+  Process(const ZslRingBuffer &ring, int count, const BurstMetadata &metadata,
+          const ProcessOptions &options = {});
+
+  // Renders a burst whose alignment pyramids were computed beforehand, so
+  // that rendering it again or after appending frames does not rebuild them.
+  // The reference is the one set on the pyramid. Previews are not supported.
+  void Process(const BurstPyramid &pyramid, const BurstMetadata &metadata,
+               const ProcessOptions &options, const RowConsumer &consume);
+
+  Halide::Runtime::Buffer<uint8_t> Process(const BurstPyramid &pyramid,
+                                           const BurstMetadata &metadata,
+                                           const ProcessOptions &options = {});
+
+  // Index of the sharpest of the first 'candidates' frames of the burst,
+  // measured by the gradient energy of their layer 1 of the alignment pyramid
+  // (frame_sharpness_frames). Only the candidates are downsampled, so it can
+  // pick the reference of a burst that is then rendered with a frame_map.
+  int SharpestFrame(const Halide::Runtime::Buffer<uint16_t> &frames,
+                    int candidates);
+
+  // Leaves out of 'frame_map' (as ProcessOptions::frame_map; empty for all
+  // frames in order) the frames whose coarse residual against its first frame
+  // exceeds BurstPyramid::RejectionThreshold, and returns the frames kept.
+  // Only layer 2 of the alignment pyramid of the frames in the map is computed
+  // (coarse_residual_frames), so rejected frames cost no pyramid either.
+  std::vector<int> RejectFrames(const Halide::Runtime::Buffer<uint16_t> &frames,
+                                const std::vector<int> &frame_map,
+                                float factor);
+
+  // Whether the scene of the burst of 'frame_map' is static, as for
+  // BurstPyramid::IsStatic, from layer 2 of the frames in the map alone
+  // (coarse_residual_frames). A static burst can be rendered with
+  // ProcessOptions::assume_static.
+  bool IsStatic(const Halide::Runtime::Buffer<uint16_t> &frames,
+                const std::vector<int> &frame_map);
+
+  // Aligns and merges the burst into one bayer frame, as stack_frames does.
+  void AlignAndMerge(const Halide::Runtime::Buffer<uint16_t> &frames,
+                     Halide::Runtime::Buffer<uint16_t> &merged);
+
+  Halide::Runtime::Buffer<uint16_t>
+  AlignAndMerge(const Halide::Runtime::Buffer<uint16_t> &frames);
+
+  // Aligns and merges a burst of 'num_frames' frames of width x height one
+  // frame at a time with a StreamingMerger, so the burst is never held in
+  // memory at once. 'source' produces frame n + 1 while frame n is merged,
+  // which hides decoding behind the merge. The result matches the output of
+  // AlignAndMerge up to the tiles along the border.
+  Halide::Runtime::Buffer<uint16_t> AlignAndMerge(int width, int height,
+                                                  int num_frames,
+                                                  const FrameSource &source);
+
+  // Renders a bayer frame produced by AlignAndMerge with the finishing stages
+  // alone, so a burst can be re-rendered with other tone mapping parameters
+  // without aligning and merging it again. The output is identical to that of
+  // Process up to the pixels next to the frame border; previews are not
+  // supported.
+  void Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+              const BurstMetadata &metadata, const ProcessOptions &options,
+              const RowConsumer &consume);
+
+  void Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+              const BurstMetadata &metadata, const ProcessOptions &options,
+              Halide::Runtime::Buffer<uint8_t> &output);
+
+  Halide::Runtime::Buffer<uint8_t>
+  Finish(const Halide::Runtime::Buffer<uint16_t> &merged,
+         const BurstMetadata &metadata, const ProcessOptions &options = {});
+
+  // Renders a merged frame once for every parameter pair in 'params'. The
+  // stages before tone mapping do not depend on the parameters and are
+  // computed once; only the tone stages run per pair, for up to 'concurrency'
+  // pairs at a time. Outputs are handed to 'consume' in the order of 'params',
+  // on the calling thread.
+  void Sweep(const Halide::Runtime::Buffer<uint16_t> &merged,
+             const BurstMetadata &metadata,
+             const std::vector<ToneParams> &params,
+             const SweepConsumer &consume, int concurrency = 1);
+
+  // Number of output rows rendered per band so that the intermediates of one
+  // band stay within 'memory_budget'. Bands are aligned to the tile grid of
+  // 'params', which must be those the pipelines were built with, and never
+  // smaller than one tile; throws std::invalid_argument if the budget does
+  // not cover even one tile row.
+  static int BandRows(int width, int height, int frames, size_t memory_budget,
+                      PipelineKind kind = PipelineKind::HDR_PLUS,
+                      const AlignParams &params = AlignParams());
+
+  // Alignment parameters of the pipelines that render with 'options': the
+  // tile size and search radius of the build, and options.coarse_u8.
+  static AlignParams GetAlignParams(const ProcessOptions &options);
+
+  const MemoryPool &GetMemoryPool() const { return Pool; }
+
+private:
+  using BandSource =
+      std::function<Halide::Runtime::Buffer<uint8_t>(int y, int rows)>;
+  using BandPipeline =
+      std::function<void(Halide::Runtime::Buffer<uint8_t> &band)>;
+
+  // Bands that all share one buffer, sized by the first and tallest band.
+  static BandSource SharedBands(const ImageRegion &region);
+
+  // Bands that are crops of 'output', which covers 'region'.
+  static BandSource OutputBands(const ImageRegion &region,
+                                Halide::Runtime::Buffer<uint8_t> &output);
+
+  void Render(const Halide::Runtime::Buffer<uint16_t> &frames,
+              const BurstMetadata &metadata, const ProcessOptions &options,
+              const BandSource &band_source, const RowConsumer &consume);
+
+  // Renders the burst of frames[slots[0]], frames[slots[1]], ... through
+  // hdrplus_from_pyramid, given the pyramid layers of all slots.
+  void RenderPyramid(const Halide::Runtime::Buffer<uint16_t> &frames,
+                     const Halide::Runtime::Buffer<uint16_t> &layer_0,
+                     const Halide::Runtime::Buffer<uint16_t> &layer_1,
+                     const Halide::Runtime::Buffer<uint16_t> &layer_2,
+                     const std::vector<int> &slots,
+                     const BurstMetadata &metadata,
+                     const ProcessOptions &options,
+                     const BandSource &band_source,
+                     const RowConsumer &consume);
+
+  // Coarse residuals of the frames of 'frame_map' against its first frame,
+  // after the alignment search and at zero offsets, in the order of the map.
+  void CoarseResiduals(const Halide::Runtime::Buffer<uint16_t> &frames,
+                       const std::vector<int> &frame_map,
+                       std::vector<float> &aligned,
+                       std::vector<float> &unaligned);
+
+  void RenderFinish(const Halide::Runtime::Buffer<uint16_t> &merged,
+                    const BurstMetadata &metadata,
+                    const ProcessOptions &options,
+                    const BandSource &band_source, const RowConsumer &consume);
+
+  static void RenderBands(const ImageRegion &region, int rows,
+                          const BandSource &band_source,
+                          const BandPipeline &pipeline,
+                          const RowConsumer &consume);
+
+  Halide::Runtime::Buffer<float>
+  GetColorCorrectionMatrix(const BurstMetadata &metadata);
+
+  // Returns the blocks the pool caches for frames of another size to the
+  // system when a burst of width x height frames starts, so a context that
+  // serves many resolutions keeps the working set of the current one only.
+  void StartBurst(int width, int height);
+
+  MemoryPool Pool;
+  int FrameWidth = 0;
+  int FrameHeight = 0;
+
+  // Most recently used color correction matrices first, at most
+  // kCcmCacheSize of them, so a long-lived context serving many cameras or
+  // illuminants does not grow without bound.
+  static constexpr size_t kCcmCacheSize = 8;
+  std::mutex CcmMutex;
+  std::list<std::pair<std::array<float, 9>, Halide::Runtime::Buffer<float>>>
+      CcmCache;
+};
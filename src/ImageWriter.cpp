@@ -0,0 +1,416 @@
+#include "ImageWriter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "ParallelFor.h"
+
+namespace {
+
+// Rows of a PNG compressed as one independent deflate block sequence
+constexpr int kPngRowsPerGroup = 64;
+
+// Rows of MCUs in a JPEG strip. Restart markers are numbered modulo 8, so
+// strips of eight MCU rows each start at RST0 and can be concatenated as is.
+constexpr int kJpegMcuRowsPerStrip = 8;
+
+// Returns a pointer to row y of rows(c, x, y) as interleaved RGB. Rows that
+// are not stored that way are copied into 'scratch'.
+const uint8_t *InterleavedRow(const Halide::Runtime::Buffer<uint8_t> &rows,
+                              int y, std::vector<uint8_t> &scratch) {
+  const int width = rows.dim(1).extent();
+  const int c_min = rows.dim(0).min();
+  const int x_min = rows.dim(1).min();
+  if (rows.dim(0).stride() == 1 && rows.dim(1).stride() == 3) {
+    return &rows(c_min, x_min, y);
+  }
+  scratch.resize(width * 3);
+  for (int x = 0; x < width; x++) {
+    for (int c = 0; c < 3; c++) {
+      scratch[3 * x + c] = rows(c_min + c, x_min + x, y);
+    }
+  }
+  return scratch.data();
+}
+
+// Row i of the rows not encoded yet, as interleaved RGB
+using RowSource =
+    std::function<const uint8_t *(int i, std::vector<uint8_t> &scratch)>;
+
+// PNG
+
+uint8_t Paeth(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+/*
+ * FilterRow -- Writes the filter type byte and the filtered row to 'out',
+ * choosing the filter with the smallest sum of absolute differences as the
+ * PNG specification suggests. 'prev' is the unfiltered previous row.
+ */
+void FilterRow(const uint8_t *row, const uint8_t *prev, int bytes,
+               uint8_t *out, std::vector<uint8_t> &candidate) {
+  constexpr int bpp = 3;
+  long best_sum = -1;
+  for (int type = 0; type < 5; type++) {
+    long sum = 0;
+    for (int i = 0; i < bytes; i++) {
+      const int a = i >= bpp ? row[i - bpp] : 0;
+      const int b = prev[i];
+      const int c = i >= bpp ? prev[i - bpp] : 0;
+      int predictor = 0;
+      switch (type) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        predictor = (a + b) / 2;
+        break;
+      case 4:
+        predictor = Paeth(a, b, c);
+        break;
+      }
+      candidate[i] = static_cast<uint8_t>(row[i] - predictor);
+      sum += std::abs(static_cast<int8_t>(candidate[i]));
+    }
+    if (best_sum < 0 || sum < best_sum) {
+      best_sum = sum;
+      out[0] = static_cast<uint8_t>(type);
+      std::copy(candidate.begin(), candidate.begin() + bytes, out + 1);
+    }
+  }
+}
+
+struct DeflatedGroup {
+  std::vector<uint8_t> data;
+  uLong adler;   // adler32 of the uncompressed filtered rows
+  size_t length; // number of uncompressed bytes
+};
+
+/*
+ * DeflateGroup -- Filters rows [begin, end) and compresses them as raw deflate
+ * blocks; 'prev' is the row above 'begin'. All but the last group of the image
+ * end with a sync flush, which aligns the output to a byte boundary without
+ * ending the stream, so the groups can be concatenated into one valid zlib
+ * stream.
+ */
+DeflatedGroup DeflateGroup(const RowSource &row_source, int width, int begin,
+                           int end, const uint8_t *prev, bool last) {
+  const int bytes = width * 3;
+  std::vector<uint8_t> prev_scratch, row_scratch, candidate(bytes);
+
+  std::vector<uint8_t> filtered(size_t(bytes + 1) * (end - begin));
+  for (int i = begin; i < end; i++) {
+    const uint8_t *row = row_source(i, row_scratch);
+    FilterRow(row, prev, bytes, &filtered[size_t(bytes + 1) * (i - begin)],
+              candidate);
+    std::swap(prev_scratch, row_scratch);
+    prev = row;
+  }
+
+  DeflatedGroup group;
+  group.length = filtered.size();
+  group.adler = adler32(adler32(0, nullptr, 0), filtered.data(),
+                        static_cast<uInt>(filtered.size()));
+
+  z_stream stream = {};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("Cannot initialize deflate");
+  }
+  // The bound does not account for the empty block of a sync flush.
+  group.data.resize(deflateBound(&stream, filtered.size()) + 16);
+  stream.next_in = filtered.data();
+  stream.avail_in = static_cast<uInt>(filtered.size());
+  stream.next_out = group.data.data();
+  stream.avail_out = static_cast<uInt>(group.data.size());
+  const int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  const bool complete = last ? result == Z_STREAM_END
+                             : result == Z_OK && stream.avail_out > 0;
+  group.data.resize(stream.total_out);
+  deflateEnd(&stream);
+  if (!complete) {
+    throw std::runtime_error("Cannot deflate image rows");
+  }
+  return group;
+}
+
+void AppendU32(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back(value >> 24);
+  out.push_back(value >> 16);
+  out.push_back(value >> 8);
+  out.push_back(value);
+}
+
+void WriteChunk(std::ofstream &file, const char *type,
+                const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> header;
+  AppendU32(header, static_cast<uint32_t>(data.size()));
+  header.insert(header.end(), type, type + 4);
+
+  uLong crc = crc32(0, header.data() + 4, 4);
+  if (!data.empty()) {
+    crc = crc32(crc, data.data(), static_cast<uInt>(data.size()));
+  }
+  std::vector<uint8_t> trailer;
+  AppendU32(trailer, static_cast<uint32_t>(crc));
+
+  file.write(reinterpret_cast<const char *>(header.data()), header.size());
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  file.write(reinterpret_cast<const char *>(trailer.data()), trailer.size());
+}
+
+// JPEG
+
+// Encodes rows [begin, end) as a complete JPEG with a restart marker after
+// every row of MCUs.
+std::vector<uint8_t> EncodeJpegStrip(const RowSource &row_source, int width,
+                                     int begin, int end, int quality) {
+
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+
+  cinfo.image_width = width;
+  cinfo.image_height = end - begin;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.restart_in_rows = 1;
+  jpeg_start_compress(&cinfo, TRUE);
+
+  std::vector<uint8_t> scratch;
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row_pointer = const_cast<uint8_t *>(
+        row_source(begin + cinfo.next_scanline, scratch));
+    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  std::vector<uint8_t> strip(buffer, buffer + size);
+  std::free(buffer);
+  return strip;
+}
+
+// Returns the offset of the entropy-coded data of a JPEG, which follows the
+// start of scan segment. If 'height' is not negative, the image height in the
+// frame header is replaced with it.
+size_t ScanDataOffset(std::vector<uint8_t> &jpeg, int height = -1) {
+  size_t pos = 2; // start of image
+  while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xff) {
+    const uint8_t marker = jpeg[pos + 1];
+    const size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+    if (marker == 0xc0 && height >= 0) {
+      jpeg[pos + 5] = height >> 8;
+      jpeg[pos + 6] = height & 0xff;
+    }
+    if (marker == 0xda) {
+      return pos + 2 + length;
+    }
+    pos += 2 + length;
+  }
+  throw std::runtime_error("Malformed JPEG strip");
+}
+
+std::string Extension(const std::string &path) {
+  const size_t dot = path.find_last_of('.');
+  if (dot == std::string::npos) {
+    return "";
+  }
+  std::string extension = path.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return extension;
+}
+
+void Write(std::ofstream &file, const std::vector<uint8_t> &data,
+           size_t begin = 0, size_t end = std::string::npos) {
+  end = std::min(end, data.size());
+  file.write(reinterpret_cast<const char *>(data.data() + begin), end - begin);
+}
+
+} // namespace
+
+
+ImageWriter::ImageWriter(const std::string &path, int width, int height,
+                         int jpeg_quality)
+    : Path(path), OutputFormat(Extension(path) == "png" ? Format::PNG
+                                                         : Format::JPEG),
+      Width(width), Height(height), JpegQuality(jpeg_quality),
+      PreviousRow(width * 3, 0), Adler(adler32(0, nullptr, 0)) {
+  const std::string extension = Extension(path);
+  if (extension != "png" && extension != "jpg" && extension != "jpeg") {
+    throw std::invalid_argument("Unsupported output format '" + path +
+                                "', expected .png, .jpg or .jpeg");
+  }
+  File.open(path, std::ofstream::binary);
+  if (!File) {
+    throw std::runtime_error("Unable to open output image '" + path + "'");
+  }
+  if (OutputFormat == Format::PNG) {
+    WriteHeader();
+  }
+}
+
+int ImageWriter::GroupRows() const {
+  // 4:2:0 chroma subsampling gives JPEG MCUs of 16x16 pixels
+  return OutputFormat == Format::PNG ? kPngRowsPerGroup
+                                     : kJpegMcuRowsPerStrip * 16;
+}
+
+void ImageWriter::WriteHeader() {
+  const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  File.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+  std::vector<uint8_t> ihdr;
+  AppendU32(ihdr, Width);
+  AppendU32(ihdr, Height);
+  // 8-bit depth, truecolor, deflate, adaptive filtering, no interlacing
+  ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+  WriteChunk(File, "IHDR", ihdr);
+}
+
+/*
+ * WriteRows -- The pending rows and the new band are split into groups, which
+ * are encoded concurrently and then written in order.
+ *
+ * PNG groups are written as IDAT chunks; the zlib header is prepended to the
+ * first group of the image and the adler32 of the whole stream, combined from
+ * the checksums of the groups, appended to the last.
+ *
+ * JPEG groups are strips of kJpegMcuRowsPerStrip MCU rows, encoded as separate
+ * JPEGs with identical tables and restart intervals. The headers of the first
+ * strip, with the full image height, are followed by the entropy-coded data of
+ * every strip, joined by the restart marker that a single-threaded encode would
+ * place there.
+ */
+void ImageWriter::WriteRows(const Halide::Runtime::Buffer<uint8_t> &rows) {
+  const int count = rows.dim(2).extent();
+  if (rows.dim(0).extent() != 3 || rows.dim(1).extent() != Width ||
+      RowsEncoded + PendingRows + count > Height) {
+    throw std::invalid_argument("Rows do not fit output image '" + Path + "'");
+  }
+
+  const int group_rows = GroupRows();
+  const int available = PendingRows + count;
+  const bool complete = RowsEncoded + available == Height;
+  const int num_groups = complete ? (available + group_rows - 1) / group_rows
+                                  : available / group_rows;
+  const int encoded_rows = std::min(available, num_groups * group_rows);
+
+  const int y_min = rows.dim(2).min();
+  const RowSource row_source = [&](int i, std::vector<uint8_t> &scratch)
+      -> const uint8_t * {
+    if (i < PendingRows) {
+      return &Pending[size_t(i) * Width * 3];
+    }
+    return InterleavedRow(rows, y_min + i - PendingRows, scratch);
+  };
+
+  std::vector<std::vector<uint8_t>> encoded(num_groups);
+  std::vector<DeflatedGroup> deflated(num_groups);
+  ParallelFor(num_groups, [&](int g) {
+    const int begin = g * group_rows;
+    const int end = std::min(available, begin + group_rows);
+    if (OutputFormat == Format::PNG) {
+      std::vector<uint8_t> scratch;
+      const uint8_t *prev =
+          begin > 0 ? row_source(begin - 1, scratch) : PreviousRow.data();
+      deflated[g] = DeflateGroup(row_source, Width, begin, end, prev,
+                                 complete && g == num_groups - 1);
+    } else {
+      encoded[g] =
+          EncodeJpegStrip(row_source, Width, begin, end, JpegQuality);
+    }
+  });
+
+  for (int g = 0; g < num_groups; g++) {
+    const bool first = RowsEncoded == 0 && g == 0;
+    const bool last = complete && g == num_groups - 1;
+    if (OutputFormat == Format::PNG) {
+      // zlib header for deflate with a 32K window
+      std::vector<uint8_t> &data = deflated[g].data;
+      Adler = adler32_combine(Adler, deflated[g].adler, deflated[g].length);
+      if (first) {
+        data.insert(data.begin(), {0x78, 0x9c});
+      }
+      if (last) {
+        AppendU32(data, static_cast<uint32_t>(Adler));
+      }
+      WriteChunk(File, "IDAT", data);
+    } else {
+      std::vector<uint8_t> &strip = encoded[g];
+      const size_t scan_begin = ScanDataOffset(strip, first ? Height : -1);
+      if (first) {
+        Write(File, strip, 0, scan_begin);
+      } else {
+        const uint8_t restart_marker[] = {0xff, 0xd7};
+        File.write(reinterpret_cast<const char *>(restart_marker), 2);
+      }
+      // everything up to the end of image marker
+      Write(File, strip, scan_begin, strip.size() - 2);
+    }
+  }
+
+  // Keep the last encoded row for the filters of the next group and the rows
+  // that did not complete a group.
+  std::vector<uint8_t> scratch;
+  if (encoded_rows > 0) {
+    const uint8_t *last_row = row_source(encoded_rows - 1, scratch);
+    std::copy(last_row, last_row + Width * 3, PreviousRow.begin());
+  }
+  std::vector<uint8_t> pending(size_t(available - encoded_rows) * Width * 3);
+  for (int i = encoded_rows; i < available; i++) {
+    const uint8_t *row = row_source(i, scratch);
+    std::copy(row, row + Width * 3,
+              pending.begin() + size_t(i - encoded_rows) * Width * 3);
+  }
+  Pending.swap(pending);
+  PendingRows = available - encoded_rows;
+  RowsEncoded += encoded_rows;
+
+  if (!File) {
+    throw std::runtime_error("Unable to write output image '" + Path + "'");
+  }
+}
+
+void ImageWriter::Finish() {
+  if (RowsEncoded != Height) {
+    throw std::runtime_error("Output image '" + Path + "' is incomplete");
+  }
+  if (OutputFormat == Format::PNG) {
+    WriteChunk(File, "IEND", {});
+  } else {
+    const uint8_t end_of_image[] = {0xff, 0xd9};
+    File.write(reinterpret_cast<const char *>(end_of_image), 2);
+  }
+  File.close();
+  if (!File) {
+    throw std::runtime_error("Unable to write output image '" + Path + "'");
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+/*
+ * ImageWriter -- Writes an 8-bit RGB image as PNG or JPEG, chosen by the
+ * extension of the path (".png", ".jpg" or ".jpeg"). Rows are handed over from
+ * top to bottom in bands of any height as soon as they are produced. Complete
+ * groups of rows are compressed in parallel and written immediately, and are
+ * joined into a single standard stream; only rows that do not yet form a
+ * complete group are kept until the next band.
+ */
+class ImageWriter {
+public:
+  ImageWriter(const std::string &path, int width, int height,
+              int jpeg_quality = 95);
+
+  // Encodes the next rows of the image. 'rows' is indexed as rows(c, x, y),
+  // the layout of the pipeline output; interleaved rows are read in place.
+  void WriteRows(const Halide::Runtime::Buffer<uint8_t> &rows);
+
+  // Ends the file once all rows have been written.
+  void Finish();
+
+private:
+  enum class Format { PNG, JPEG };
+
+  // Rows compressed as one independent group
+  int GroupRows() const;
+
+  void WriteHeader();
+
+  const std::string Path;
+  const Format OutputFormat;
+  const int Width;
+  const int Height;
+  const int JpegQuality;
+
+  std::ofstream File;
+  int RowsEncoded = 0;
+  // Rows of the last band that did not complete a group, interleaved
+  std::vector<uint8_t> Pending;
+  int PendingRows = 0;
+  // Last encoded row, which the PNG filters of the next group refer to
+  std::vector<uint8_t> PreviousRow;
+  // adler32 of the uncompressed PNG data encoded so far
+  unsigned long Adler;
+};
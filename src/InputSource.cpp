@@ -1,11 +1,14 @@
 #include "InputSource.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <unordered_map>
 
 #include "LibRaw2DngConverter.h"
 
-RawImage::RawImage(const std::string &path)
+RawImage::RawImage(const std::string &path, bool decode)
     : Path(path), RawProcessor(std::make_shared<LibRaw>()) {
   //    TODO: Check LibRaw parametres.
   //    RawProcessor->imgdata.params.X = Y;
@@ -16,16 +19,78 @@ RawImage::RawImage(const std::string &path)
               << " error: " << libraw_strerror(err) << std::endl;
     throw std::runtime_error("Error opening " + path);
   }
-  if (int err = RawProcessor->unpack()) {
-    std::cerr << "Cannot unpack file " << path
+  if (decode) {
+    Decode();
+  }
+}
+
+RawImage::RawImage(const std::string &path,
+                   std::shared_ptr<MappedFile> mapping, bool decode)
+    : Path(path), Mapping(std::move(mapping)),
+      RawProcessor(std::make_shared<LibRaw>()) {
+  std::cerr << "Opening " << path << " (mapped)" << std::endl;
+  if (int err = RawProcessor->open_buffer(Mapping->GetData(),
+                                          Mapping->GetSize())) {
+    std::cerr << "Cannot open file " << path
+              << " error: " << libraw_strerror(err) << std::endl;
+    throw std::runtime_error("Error opening " + path);
+  }
+  if (decode) {
+    Decode();
+  }
+}
+
+FrameInfo RawImage::Probe(const std::string &path) {
+  LibRaw raw_processor;
+  if (int err = raw_processor.open_file(path.c_str())) {
+    std::cerr << "Cannot open file " << path
               << " error: " << libraw_strerror(err) << std::endl;
     throw std::runtime_error("Error opening " + path);
   }
+  return GetInfo(path, raw_processor);
+}
+
+FrameInfo RawImage::GetInfo() const { return GetInfo(Path, *RawProcessor); }
+
+FrameInfo RawImage::GetInfo(const std::string &path, LibRaw &raw_processor) {
+  FrameInfo info;
+  info.path = path;
+  info.width = raw_processor.imgdata.sizes.width;
+  info.height = raw_processor.imgdata.sizes.height;
+  try {
+    info.cfa_pattern = GetCfaPattern(raw_processor);
+  } catch (const std::exception &) {
+    info.cfa_pattern = CfaPattern::CFA_UNKNOWN;
+  }
+  info.exposure_time = raw_processor.imgdata.other.shutter;
+  info.iso = raw_processor.imgdata.other.iso_speed;
+  info.timestamp = raw_processor.imgdata.other.timestamp;
+  return info;
+}
+
+std::ostream &operator<<(std::ostream &os, const FrameInfo &info) {
+  static const char *CFA_NAMES[] = {"unknown", "RGGB", "GRBG", "BGGR", "GBRG"};
+  return os << info.path << ": " << info.width << "x" << info.height << " "
+            << CFA_NAMES[static_cast<int>(info.cfa_pattern)]
+            << ", exposure " << info.exposure_time << " s, ISO " << info.iso
+            << ", timestamp " << info.timestamp;
+}
+
+void RawImage::Decode() {
+  if (Decoded) {
+    return;
+  }
+  if (int err = RawProcessor->unpack()) {
+    std::cerr << "Cannot unpack file " << Path
+              << " error: " << libraw_strerror(err) << std::endl;
+    throw std::runtime_error("Error opening " + Path);
+  }
   if (int ret = RawProcessor->raw2image()) {
-    std::cerr << "Cannot do raw2image on " << path
+    std::cerr << "Cannot do raw2image on " << Path
               << " error: " << libraw_strerror(ret) << std::endl;
-    throw std::runtime_error("Error opening " + path);
+    throw std::runtime_error("Error opening " + Path);
   }
+  Decoded = true;
 }
 
 WhiteBalance RawImage::GetWhiteBalance() const {
@@ -50,10 +115,11 @@ void RawImage::CopyToBuffer(Halide::Runtime::Buffer<uint16_t> &buffer) const {
 }
 
 void RawImage::WriteDng(const std::string &output_path,
-                        const Halide::Runtime::Buffer<uint16_t> &buffer) const {
-  LibRaw2DngConverter converter(*this);
+                        const Halide::Runtime::Buffer<uint16_t> &buffer,
+                        DngCompression compression) const {
+  LibRaw2DngConverter converter(*this, output_path, compression);
   converter.SetBuffer(buffer);
-  converter.Write(output_path);
+  converter.Write();
 }
 
 std::array<float, 4> RawImage::GetBlackLevel() const {
@@ -86,17 +152,25 @@ int RawImage::GetScalarBlackLevel() const {
 }
 
 std::string RawImage::GetCfaPatternString() const {
+  return GetCfaPatternString(*RawProcessor);
+}
+
+std::string RawImage::GetCfaPatternString(LibRaw &raw_processor) {
   static const std::unordered_map<char, char> CDESC_TO_CFA = {
       {'R', 0}, {'G', 1}, {'B', 2}, {'r', 0}, {'g', 1}, {'b', 2}};
-  const auto &cdesc = RawProcessor->imgdata.idata.cdesc;
-  return {CDESC_TO_CFA.at(cdesc[RawProcessor->COLOR(0, 0)]),
-          CDESC_TO_CFA.at(cdesc[RawProcessor->COLOR(0, 1)]),
-          CDESC_TO_CFA.at(cdesc[RawProcessor->COLOR(1, 0)]),
-          CDESC_TO_CFA.at(cdesc[RawProcessor->COLOR(1, 1)])};
+  const auto &cdesc = raw_processor.imgdata.idata.cdesc;
+  return {CDESC_TO_CFA.at(cdesc[raw_processor.COLOR(0, 0)]),
+          CDESC_TO_CFA.at(cdesc[raw_processor.COLOR(0, 1)]),
+          CDESC_TO_CFA.at(cdesc[raw_processor.COLOR(1, 0)]),
+          CDESC_TO_CFA.at(cdesc[raw_processor.COLOR(1, 1)])};
 }
 
 CfaPattern RawImage::GetCfaPattern() const {
-  const auto cfa_pattern = GetCfaPatternString();
+  return GetCfaPattern(*RawProcessor);
+}
+
+CfaPattern RawImage::GetCfaPattern(LibRaw &raw_processor) {
+  const auto cfa_pattern = GetCfaPatternString(raw_processor);
   if (cfa_pattern == std::string{0, 1, 1, 2}) {
     return CfaPattern::CFA_RGGB;
   } else if (cfa_pattern == std::string{1, 0, 2, 1}) {
@@ -120,3 +194,104 @@ Halide::Runtime::Buffer<float> RawImage::GetColorCorrectionMatrix() const {
   }
   return ccm;
 }
+
+BurstMetadata RawImage::GetMetadata() const {
+  BurstMetadata metadata;
+  metadata.black_level = GetScalarBlackLevel();
+  metadata.white_level = GetWhiteLevel();
+  metadata.white_balance = GetWhiteBalance();
+  metadata.cfa_pattern = GetCfaPattern();
+  const auto ccm = GetColorCorrectionMatrix();
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      metadata.color_correction[j * 3 + i] = ccm(i, j);
+    }
+  }
+  return metadata;
+}
+
+namespace {
+
+// Colors of the top-left 2x2 quad of each pattern, in row-major order
+const std::unordered_map<CfaPattern, std::array<int, 4>> CFA_COLORS = {
+    {CfaPattern::CFA_RGGB, {0, 1, 1, 2}},
+    {CfaPattern::CFA_GRBG, {1, 0, 2, 1}},
+    {CfaPattern::CFA_BGGR, {2, 1, 1, 0}},
+    {CfaPattern::CFA_GBRG, {1, 2, 0, 1}}};
+
+// Pattern seen from an origin moved by (dx, dy) pixels
+CfaPattern ShiftCfaPattern(CfaPattern pattern, int dx, int dy) {
+  const auto &colors = CFA_COLORS.at(pattern);
+  std::array<int, 4> shifted;
+  for (int y = 0; y < 2; y++) {
+    for (int x = 0; x < 2; x++) {
+      shifted[y * 2 + x] = colors[((y + dy) % 2) * 2 + (x + dx) % 2];
+    }
+  }
+  for (const auto &[candidate, candidate_colors] : CFA_COLORS) {
+    if (candidate_colors == shifted) {
+      return candidate;
+    }
+  }
+  return CfaPattern::CFA_UNKNOWN;
+}
+
+// Checks the size and strides of a burst of bayer frames, which Halide holds
+// as 32-bit integers.
+void CheckBayerLayout(int width, int height, int num_frames,
+                      ptrdiff_t row_stride, ptrdiff_t frame_stride) {
+  constexpr ptrdiff_t max_stride = std::numeric_limits<int32_t>::max();
+  if (width <= 0 || height <= 0 || num_frames <= 0 || row_stride < width ||
+      row_stride > max_stride || frame_stride < row_stride * height ||
+      frame_stride > max_stride) {
+    throw std::invalid_argument("Invalid bayer frame layout");
+  }
+}
+
+} // namespace
+
+BayerInput::BayerInput(const uint16_t *data, int width, int height,
+                       int num_frames, ptrdiff_t row_stride,
+                       ptrdiff_t frame_stride, const BurstMetadata &metadata)
+    : Metadata(metadata) {
+  if (data == nullptr) {
+    throw std::invalid_argument("Invalid bayer frame layout");
+  }
+  CheckBayerLayout(width, height, num_frames, row_stride, frame_stride);
+  halide_dimension_t shape[3] = {
+      {0, width, 1, 0},
+      {0, height, static_cast<int32_t>(row_stride), 0},
+      {0, num_frames, static_cast<int32_t>(frame_stride), 0}};
+  // The pipelines only read their inputs.
+  Frames = Halide::Runtime::Buffer<uint16_t>(const_cast<uint16_t *>(data), 3,
+                                             shape);
+}
+
+BayerInput BayerInput::FromFileDescriptor(int fd, size_t offset, int width,
+                                          int height, int num_frames,
+                                          ptrdiff_t row_stride,
+                                          ptrdiff_t frame_stride,
+                                          const BurstMetadata &metadata) {
+  CheckBayerLayout(width, height, num_frames, row_stride, frame_stride);
+  const size_t bytes =
+      (size_t(frame_stride) * (num_frames - 1) +
+       size_t(row_stride) * (height - 1) + width) *
+      sizeof(uint16_t);
+  auto mapping = std::make_shared<MappedFile>(fd, offset, bytes);
+  BayerInput input(static_cast<const uint16_t *>(mapping->GetData()), width,
+                   height, num_frames, row_stride, frame_stride, metadata);
+  input.Mapping = std::move(mapping);
+  return input;
+}
+
+void BayerInput::Crop(int x, int y, int width, int height) {
+  if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+      x + width > GetWidth() || y + height > GetHeight()) {
+    throw std::invalid_argument("Crop exceeds the bayer frames");
+  }
+  Frames.crop(0, x, width);
+  Frames.crop(1, y, height);
+  // The pipelines expect frames to start at the origin.
+  Frames.set_min(0, 0, 0);
+  Metadata.cfa_pattern = ShiftCfaPattern(Metadata.cfa_pattern, x % 2, y % 2);
+}
@@ -1,16 +1,53 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
+#include <ctime>
+#include <memory>
+#include <ostream>
 #include <string>
 
 #include <libraw/libraw.h>
 
+#include "BurstMetadata.h"
+#include "LibRaw2DngConverter.h"
+#include "MappedFile.h"
 #include "finish.h"
 #include <Halide.h>
 
+// Header information of a raw file, available without decoding it
+struct FrameInfo {
+  std::string path;
+  int width = 0;
+  int height = 0;
+  CfaPattern cfa_pattern = CfaPattern::CFA_UNKNOWN;
+  float exposure_time = 0.f; // seconds
+  float iso = 0.f;
+  std::time_t timestamp = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const FrameInfo &info);
+
 class RawImage {
 public:
-  explicit RawImage(const std::string &path);
+  // Unless 'decode' is false, the pixels are unpacked right away; otherwise
+  // only the header is parsed until Decode() is called.
+  explicit RawImage(const std::string &path, bool decode = true);
+
+  // Decodes the file from a memory mapping of it instead of reading it
+  // through LibRaw's file stream. The mapping is kept alive by this object.
+  RawImage(const std::string &path, std::shared_ptr<MappedFile> mapping,
+           bool decode = true);
+
+  // Reads only the header of a raw file, without unpacking its pixels.
+  static FrameInfo Probe(const std::string &path);
+
+  // Header information of the opened file
+  FrameInfo GetInfo() const;
+
+  // Unpacks the pixels of an image opened with 'decode' set to false. Does
+  // nothing if they are unpacked already.
+  void Decode();
 
   ~RawImage() = default;
 
@@ -31,16 +68,75 @@ public:
 
   Halide::Runtime::Buffer<float> GetColorCorrectionMatrix() const;
 
+  // Metadata of this frame, as passed to HdrPlusContext for a burst with this
+  // frame as the reference
+  BurstMetadata GetMetadata() const;
+
   void CopyToBuffer(Halide::Runtime::Buffer<uint16_t> &buffer) const;
 
   // Writes current RawImage as DNG. If buffer was provided, then use it instead
   // of internal buffer.
   void WriteDng(const std::string &path,
-                const Halide::Runtime::Buffer<uint16_t> &buffer = {}) const;
+                const Halide::Runtime::Buffer<uint16_t> &buffer = {},
+                DngCompression compression = DngCompression::DEFLATE) const;
 
   std::shared_ptr<LibRaw> GetRawProcessor() const { return RawProcessor; }
 
 private:
+  static FrameInfo GetInfo(const std::string &path, LibRaw &raw_processor);
+
+  static std::string GetCfaPatternString(LibRaw &raw_processor);
+
+  static CfaPattern GetCfaPattern(LibRaw &raw_processor);
+
   std::string Path;
+  std::shared_ptr<MappedFile> Mapping;
   std::shared_ptr<LibRaw> RawProcessor;
+  bool Decoded = false;
+};
+
+/*
+ * BayerInput -- Burst of already unpacked 16-bit bayer frames owned by the
+ * caller, for example frames a capture service keeps in shared memory. The
+ * frames are wrapped as the frames(x, y, n) buffer the pipelines read, without
+ * copying and without going through LibRaw. Rows and frames may be padded;
+ * strides are given in samples.
+ */
+class BayerInput {
+public:
+  BayerInput(const uint16_t *data, int width, int height, int num_frames,
+             ptrdiff_t row_stride, ptrdiff_t frame_stride,
+             const BurstMetadata &metadata);
+
+  // Maps the frames from a file descriptor, such as a memfd, starting at byte
+  // 'offset'. The mapping is kept alive by this object and its copies.
+  static BayerInput FromFileDescriptor(int fd, size_t offset, int width,
+                                       int height, int num_frames,
+                                       ptrdiff_t row_stride,
+                                       ptrdiff_t frame_stride,
+                                       const BurstMetadata &metadata);
+
+  // Restricts all frames to a rectangle. An odd offset shifts the CFA pattern
+  // of the metadata accordingly.
+  void Crop(int x, int y, int width, int height);
+
+  int GetWidth() const { return Frames.width(); }
+
+  int GetHeight() const { return Frames.height(); }
+
+  int GetNumFrames() const { return Frames.extent(2); }
+
+  const BurstMetadata &GetMetadata() const { return Metadata; }
+
+  // All frames, sharing the memory of the caller
+  const Halide::Runtime::Buffer<uint16_t> &GetFrames() const { return Frames; }
+
+  Halide::Runtime::Buffer<uint16_t> GetFrame(int n) const {
+    return Frames.sliced(2, n);
+  }
+
+private:
+  std::shared_ptr<MappedFile> Mapping;
+  Halide::Runtime::Buffer<uint16_t> Frames;
+  BurstMetadata Metadata;
 };
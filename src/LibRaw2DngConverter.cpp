@@ -1,15 +1,34 @@
 #include "LibRaw2DngConverter.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
 #include <unordered_map>
 
 #include <libraw/libraw.h>
+#include <zlib.h>
 
 #include "InputSource.h"
+#include "ParallelFor.h"
 
-LibRaw2DngConverter::LibRaw2DngConverter(const RawImage &raw)
-    : OutputStream(), Raw(raw),
-      Tiff(SetTiffFields(
-          TiffPtr(TIFFStreamOpen("", &OutputStream), TIFFClose))) {}
+namespace {
+
+std::shared_ptr<TIFF> OpenTiff(const std::string &path) {
+  TIFF *tiff = TIFFOpen(path.c_str(), "w");
+  if (tiff == nullptr) {
+    throw std::runtime_error("Cannot open " + path + " for writing");
+  }
+  return {tiff, TIFFClose};
+}
+
+} // namespace
+
+LibRaw2DngConverter::LibRaw2DngConverter(const RawImage &raw,
+                                         const std::string &path,
+                                         DngCompression compression)
+    : Raw(raw), Compression(compression),
+      Tiff(SetTiffFields(OpenTiff(path))) {}
 
 LibRaw2DngConverter::TiffPtr
 LibRaw2DngConverter::SetTiffFields(LibRaw2DngConverter::TiffPtr tiff_ptr) {
@@ -22,9 +41,15 @@ LibRaw2DngConverter::SetTiffFields(LibRaw2DngConverter::TiffPtr tiff_ptr) {
   TIFFSetField(tiff, TIFFTAG_DNGVERSION, "\01\04\00\00");
   TIFFSetField(tiff, TIFFTAG_DNGBACKWARDVERSION, "\01\04\00\00");
   TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, 0);
-  TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  if (Compression == DngCompression::DEFLATE) {
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField(tiff, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+  } else {
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  }
   TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 16);
-  TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, 1);
+  TIFFSetField(tiff, TIFFTAG_TILEWIDTH, TileSize);
+  TIFFSetField(tiff, TIFFTAG_TILELENGTH, TileSize);
   TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
   TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
   TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
@@ -72,6 +97,57 @@ LibRaw2DngConverter::SetTiffFields(LibRaw2DngConverter::TiffPtr tiff_ptr) {
   return tiff_ptr;
 }
 
+/*
+ * CopyTile -- Copies the tile at (tile_x, tile_y) out of the buffer, zero
+ * padded at the right and bottom edges of the image.
+ */
+void LibRaw2DngConverter::CopyTile(
+    const Halide::Runtime::Buffer<uint16_t> &buffer, int tile_x, int tile_y,
+    std::vector<uint16_t> &tile) const {
+  const int tile_width = std::min<int>(TileSize, buffer.width() - tile_x);
+  const int tile_height = std::min<int>(TileSize, buffer.height() - tile_y);
+
+  std::fill(tile.begin(), tile.end(), 0);
+  for (int y = 0; y < tile_height; y++) {
+    const uint16_t *row = &buffer(buffer.dim(0).min() + tile_x,
+                                  buffer.dim(1).min() + tile_y + y);
+    std::copy(row, row + tile_width, tile.begin() + y * TileSize);
+  }
+}
+
+/*
+ * EncodeTile -- Returns the bytes stored in the file for one tile. For deflate,
+ * each row is replaced by its horizontal differences (TIFF predictor 2), which
+ * is the same in native byte order as the file, and then compressed as a zlib
+ * stream. The tile is modified in place.
+ */
+std::vector<uint8_t>
+LibRaw2DngConverter::EncodeTile(std::vector<uint16_t> &tile) const {
+  const size_t bytes = tile.size() * sizeof(uint16_t);
+  if (Compression == DngCompression::NONE) {
+    std::vector<uint8_t> encoded(bytes);
+    std::memcpy(encoded.data(), tile.data(), bytes);
+    return encoded;
+  }
+
+  for (uint32_t y = 0; y < TileSize; y++) {
+    uint16_t *row = tile.data() + y * TileSize;
+    for (uint32_t x = TileSize - 1; x > 0; x--) {
+      row[x] -= row[x - 1];
+    }
+  }
+
+  uLongf encoded_size = compressBound(bytes);
+  std::vector<uint8_t> encoded(encoded_size);
+  if (compress2(encoded.data(), &encoded_size,
+                reinterpret_cast<const Bytef *>(tile.data()), bytes,
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    throw std::runtime_error("Cannot compress DNG tile");
+  }
+  encoded.resize(encoded_size);
+  return encoded;
+}
+
 void LibRaw2DngConverter::SetBuffer(
     const Halide::Runtime::Buffer<uint16_t> &buffer) const {
   const auto width = buffer.width();
@@ -80,16 +156,29 @@ void LibRaw2DngConverter::SetBuffer(
   TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
   TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
 
-  uint16_t *row_pointer = buffer.data();
-  for (int row = 0; row < height; row++) {
-    TIFFWriteScanline(tiff, row_pointer, row, 0);
-    row_pointer += width;
+  // Only one row of tiles is held in memory at a time. Its tiles are encoded
+  // concurrently and then written in file order.
+  const int tiles_across = (width + TileSize - 1) / TileSize;
+  std::vector<std::vector<uint8_t>> encoded(tiles_across);
+
+  for (int tile_y = 0; tile_y < height; tile_y += TileSize) {
+    ParallelFor(tiles_across, [&](int t) {
+      std::vector<uint16_t> tile(TileSize * TileSize);
+      CopyTile(buffer, t * TileSize, tile_y, tile);
+      encoded[t] = EncodeTile(tile);
+    });
+
+    for (int t = 0; t < tiles_across; t++) {
+      const ttile_t index = TIFFComputeTile(tiff, t * TileSize, tile_y, 0, 0);
+      if (TIFFWriteRawTile(tiff, index, encoded[t].data(), encoded[t].size()) <
+          0) {
+        throw std::runtime_error("Cannot write DNG tile");
+      }
+    }
   }
 }
 
-void LibRaw2DngConverter::Write(const std::string &path) const {
-  TIFFCheckpointDirectory(Tiff.get());
-  TIFFFlush(Tiff.get());
-  std::ofstream output(path, std::ofstream::binary);
-  output << OutputStream.str();
+void LibRaw2DngConverter::Write() {
+  TIFFWriteDirectory(Tiff.get());
+  Tiff.reset();
 }
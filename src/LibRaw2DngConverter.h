@@ -1,26 +1,49 @@
 #pragma once
 
-#include <sstream>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 #include <tiffio.h>
-#include <tiffio.hxx>
 
 #include <HalideBuffer.h>
 
 class RawImage;
 
+enum class DngCompression : int {
+  NONE = 0,
+  DEFLATE = 1, // Adobe Deflate with horizontal differencing
+};
+
+/*
+ * LibRaw2DngConverter -- Writes a bayer buffer as a DNG carrying the metadata
+ * of a RawImage. Image data is streamed straight to the destination file in
+ * tiles, so memory use does not depend on the image size. The tiles of each
+ * row of tiles are compressed concurrently and then written in order.
+ */
 class LibRaw2DngConverter {
   using TiffPtr = std::shared_ptr<TIFF>;
   TiffPtr SetTiffFields(TiffPtr tiff_ptr);
 
 public:
-  explicit LibRaw2DngConverter(const RawImage &raw);
+  LibRaw2DngConverter(const RawImage &raw, const std::string &path,
+                      DngCompression compression = DngCompression::DEFLATE);
 
   void SetBuffer(const Halide::Runtime::Buffer<uint16_t> &buffer) const;
 
-  void Write(const std::string &path) const;
+  // Writes the remaining tags and closes the file.
+  void Write();
 
 private:
-  std::ostringstream OutputStream;
+  // Width and height of the tiles the image data is written in
+  static constexpr uint32_t TileSize = 256;
+
+  void CopyTile(const Halide::Runtime::Buffer<uint16_t> &buffer, int tile_x,
+                int tile_y, std::vector<uint16_t> &tile) const;
+
+  std::vector<uint8_t> EncodeTile(std::vector<uint16_t> &tile) const;
+
   const RawImage &Raw;
+  const DngCompression Compression;
   std::shared_ptr<TIFF> Tiff;
 };
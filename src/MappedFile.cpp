@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef _WIN32
+  throw std::runtime_error("Memory mapped input is not supported on Windows");
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  try {
+    Map(fd, 0, 0, path);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+#endif
+}
+
+MappedFile::MappedFile(int fd, size_t offset, size_t length) {
+  Map(fd, offset, length, "file descriptor " + std::to_string(fd));
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (Mapping != nullptr) {
+    munmap(Mapping, MappingSize);
+  }
+#endif
+}
+
+void MappedFile::AdviseSequential() const {
+#ifndef _WIN32
+  madvise(Mapping, MappingSize, MADV_SEQUENTIAL);
+  madvise(Mapping, MappingSize, MADV_WILLNEED);
+#endif
+}
+
+void MappedFile::Map(int fd, size_t offset, size_t length,
+                     const std::string &name) {
+#ifdef _WIN32
+  (void)fd;
+  (void)offset;
+  (void)length;
+  throw std::runtime_error("Memory mapped input is not supported on Windows");
+#else
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    throw std::runtime_error("Cannot stat " + name);
+  }
+  const size_t file_size = static_cast<size_t>(st.st_size);
+  if (offset > file_size || length > file_size - offset) {
+    throw std::invalid_argument("Mapped range exceeds the size of " + name);
+  }
+  if (length == 0) {
+    length = file_size - offset;
+  }
+  if (length == 0) {
+    throw std::invalid_argument("Cannot map empty " + name);
+  }
+
+  // mmap offsets must be page aligned.
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t aligned_offset = offset / page_size * page_size;
+  MappingSize = length + (offset - aligned_offset);
+  Mapping = mmap(nullptr, MappingSize, PROT_READ, MAP_SHARED, fd,
+                 static_cast<off_t>(aligned_offset));
+  if (Mapping == MAP_FAILED) {
+    Mapping = nullptr;
+    throw std::runtime_error("Cannot map " + name);
+  }
+  Data = static_cast<const char *>(Mapping) + (offset - aligned_offset);
+  Size = length;
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*
+ * MappedFile -- Read-only memory mapping of a file, or of a byte range of an
+ * open file descriptor such as a memfd shared with another process. The
+ * mapping is released on destruction; a descriptor passed in stays owned by
+ * the caller.
+ */
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+
+  // Maps 'length' bytes starting at 'offset', which need not be page aligned.
+  // A length of 0 maps up to the end of the file.
+  MappedFile(int fd, size_t offset = 0, size_t length = 0);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const void *GetData() const { return Data; }
+
+  size_t GetSize() const { return Size; }
+
+  // Tells the kernel that the mapping will be read once from start to end and
+  // starts reading it ahead in the background.
+  void AdviseSequential() const;
+
+private:
+  void Map(int fd, size_t offset, size_t length, const std::string &name);
+
+  void *Mapping = nullptr; // page aligned start of the mapping
+  size_t MappingSize = 0;
+  const void *Data = nullptr;
+  size_t Size = 0;
+};
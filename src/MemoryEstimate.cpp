@@ -0,0 +1,160 @@
+#include "MemoryEstimate.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "MemoryPool.h"
+
+namespace {
+
+// Phases of the pipelines in the order their root stages are produced
+enum Phase : int {
+  ALIGN_PYRAMID,
+  ALIGN_SEARCH,
+  MERGE_WEIGHTS,
+  MERGE_TEMPORAL,
+  MERGE_SPATIAL,
+  WHITE_BALANCE,
+  DEMOSAIC,
+  TONE_MAP,
+  GAMMA_CORRECT,
+  CONTRAST,
+  NUM_PHASES
+};
+
+// Region a root stage is computed over
+enum class Region {
+  FULL,    // the rendered rows plus the halo of the finishing filters
+  PYRAMID, // the rendered rows plus the halo of the coarse alignment tiles
+};
+
+struct Stage {
+  double bytes_per_pixel; // per pixel of the full resolution frame
+  Region region;
+  Phase first; // phase producing the stage
+  Phase last;  // phase of the last consumer
+};
+
+// Rows on each side of a band needed by the demosaic, gauss and tone-map
+// stencils of finish.
+constexpr int kFinishHaloRows = 64;
+
+// Rows on each side of a band covered by the tiles of the coarsest alignment
+// layer, and pixels the mirrored alignment layers extend past the frame, in
+// tiles of the bayer image.
+constexpr int kPyramidHaloTiles = 2 * DOWNSAMPLE_RATE * DOWNSAMPLE_RATE;
+constexpr int kPyramidMarginTiles = 8;
+
+// Factor by which a measured peak may exceed the prediction
+constexpr double kEstimateTolerance = 1.25;
+
+std::vector<Stage> RootStages(PipelineKind kind, int frames) {
+  const double n = frames;
+  std::vector<Stage> stages;
+  if (kind == PipelineKind::HDR_PLUS ||
+      kind == PipelineKind::ALIGN_AND_MERGE) {
+    stages = {
+        // align
+        {n / 2, Region::PYRAMID, ALIGN_PYRAMID, ALIGN_SEARCH},   // layer_0
+        {n / 32, Region::PYRAMID, ALIGN_PYRAMID, ALIGN_SEARCH},  // layer_1
+        {n / 512, Region::PYRAMID, ALIGN_PYRAMID, ALIGN_SEARCH}, // layer_2
+        // merge
+        {n / 2, Region::PYRAMID, MERGE_WEIGHTS, MERGE_WEIGHTS}, // merge_layer
+        {16, Region::FULL, MERGE_TEMPORAL, MERGE_SPATIAL}, // f32, 4 tiles/px
+    };
+  }
+  if (kind == PipelineKind::ALIGN_AND_MERGE) {
+    // the spatially merged frame is the output of the pipeline
+    return stages;
+  }
+  if (kind == PipelineKind::HDR_PLUS) {
+    // the merged frame; finish_pipeline reads it from its input buffer
+    stages.push_back({2, Region::FULL, MERGE_SPATIAL, WHITE_BALANCE});
+  }
+  const std::vector<Stage> finish_stages = {
+      {2, Region::FULL, WHITE_BALANCE, DEMOSAIC},       // white balance
+      {8, Region::FULL, DEMOSAIC, DEMOSAIC},            // demosaic_0 .. 3
+      {6, Region::FULL, DEMOSAIC, GAMMA_CORRECT},       // demosaic output
+      {2, Region::FULL, TONE_MAP, GAMMA_CORRECT},       // grayscale
+      // one pass of exposure fusion: gamma corrected dark and bright images,
+      // gauss layers of both, float masks, the accumulator and the result
+      {32, Region::FULL, TONE_MAP, TONE_MAP},
+      {6, Region::FULL, GAMMA_CORRECT, CONTRAST}, // gamma corrected rgb
+      {6, Region::FULL, CONTRAST, CONTRAST},      // contrast output
+  };
+  auto first = finish_stages.begin();
+  if (kind == PipelineKind::TONE) {
+    // finish_tone reads the color corrected image from its input buffer
+    first += 3;
+  }
+  stages.insert(stages.end(), first, finish_stages.end());
+  return stages;
+}
+
+} // namespace
+
+size_t EstimatePipelineMemory(PipelineKind kind, int width, int height,
+                              int frames, int rows, const AlignParams &params) {
+  const int halo_rows = kPyramidHaloTiles * params.tile_size;
+  const int margin = kPyramidMarginTiles * params.tile_size;
+  const double full_pixels =
+      double(width) * std::min(height, rows + 2 * kFinishHaloRows);
+  const double pyramid_pixels = double(width + 2 * margin) *
+                                (std::min(height, rows + 2 * halo_rows) +
+                                 2 * margin);
+
+  std::vector<size_t> live(NUM_PHASES, 0);
+  for (const Stage &stage : RootStages(kind, frames)) {
+    const double pixels =
+        stage.region == Region::FULL ? full_pixels : pyramid_pixels;
+    // Round like the pool does, so that the estimate is comparable to its
+    // high-water mark.
+    const size_t bytes = MemoryPool::BlockSize(
+        static_cast<size_t>(stage.bytes_per_pixel * pixels));
+    for (int phase = stage.first; phase <= stage.last; phase++) {
+      live[phase] += bytes;
+    }
+  }
+  return *std::max_element(live.begin(), live.end());
+}
+
+MemoryEstimate EstimatePeakMemory(PipelineKind kind, int width, int height,
+                                  int frames) {
+  const size_t pixels = size_t(width) * height;
+
+  MemoryEstimate estimate;
+  // LibRaw keeps the unpacked 16-bit raw data and the 4-channel image produced
+  // by raw2image for every frame.
+  if (kind == PipelineKind::FINISH) {
+    // the merged frame is read back from the cache, nothing is decoded
+    estimate.input_buffer = pixels * 2;
+  } else if (kind == PipelineKind::TONE) {
+    // the 16-bit linear sRGB image shared by all parameter pairs
+    estimate.input_buffer = pixels * 6;
+  } else {
+    estimate.decoded_frames = frames * pixels * (2 + 8);
+    estimate.input_buffer = frames * pixels * 2;
+  }
+  estimate.pipeline =
+      EstimatePipelineMemory(kind, width, height, frames, height);
+  if (kind != PipelineKind::ALIGN_AND_MERGE) {
+    // 8-bit RGB output; it is encoded while the pipeline produces it
+    estimate.output = pixels * 3;
+  } else {
+    // 16-bit merged frame; the DNG is streamed to disk tile by tile
+    estimate.output = pixels * 2;
+  }
+  return estimate;
+}
+
+bool WithinEstimate(size_t measured, size_t predicted) {
+  return measured <= kEstimateTolerance * predicted;
+}
+
+std::ostream &operator<<(std::ostream &os, const MemoryEstimate &estimate) {
+  return os << "decoded_frames: " << estimate.decoded_frames << "\n"
+            << "input_buffer: " << estimate.input_buffer << "\n"
+            << "pipeline: " << estimate.pipeline << "\n"
+            << "output: " << estimate.output << "\n"
+            << "total: " << estimate.Total();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+
+#include "AlignParams.h"
+
+enum class PipelineKind : int {
+  HDR_PLUS = 0,        // hdrplus_pipeline: align, merge and finish
+  ALIGN_AND_MERGE = 1, // align_and_merge, as used by stack_frames
+  FINISH = 2,          // finish_pipeline, from an already merged frame
+  TONE = 3,            // finish_tone, from the output of finish_prefix
+};
+
+/*
+ * MemoryEstimate -- Predicted peak memory of processing one burst, split by
+ * owner. 'pipeline' covers the Halide intermediates and is what the
+ * MemoryPool high-water mark measures.
+ */
+struct MemoryEstimate {
+  size_t decoded_frames = 0; // LibRaw buffers kept for every frame
+  size_t input_buffer = 0;   // all frames copied into one 16-bit buffer
+  size_t pipeline = 0;       // Halide intermediates at their peak
+  size_t output = 0;         // output buffer and encoder copies
+
+  size_t Total() const {
+    return decoded_frames + input_buffer + pipeline + output;
+  }
+};
+
+/*
+ * EstimatePipelineMemory -- Predicts the peak size of the Halide intermediates
+ * when 'rows' rows of the output of a width x height burst of 'frames' frames
+ * are rendered in one call. The prediction follows the compute_root layout of
+ * align, merge and finish: every root stage is live from the phase in which it
+ * is produced to the phase of its last consumer, and the peak is the largest
+ * sum of live stages over all phases. The alignment layers cover a halo of
+ * coarse tiles around the rows, which grows with params.tile_size.
+ */
+size_t EstimatePipelineMemory(PipelineKind kind, int width, int height,
+                              int frames, int rows,
+                              const AlignParams &params = AlignParams());
+
+/*
+ * EstimatePeakMemory -- Predicts the peak memory of processing a whole
+ * width x height burst of 'frames' frames in one pass, including decoded
+ * frames, the input buffer and the output.
+ */
+MemoryEstimate EstimatePeakMemory(PipelineKind kind, int width, int height,
+                                  int frames);
+
+/*
+ * WithinEstimate -- Whether a measured peak of the pipeline intermediates,
+ * such as the MemoryPool high-water mark, is consistent with the prediction
+ * of EstimatePipelineMemory. The model leaves out small stages and the
+ * rounding of bounds inference, so a margin above the prediction is allowed.
+ */
+bool WithinEstimate(size_t measured, size_t predicted);
+
+/*
+ * operator<< -- Prints an estimate as one "name: bytes" line per owner and a
+ * final total, for consumption by job schedulers.
+ */
+std::ostream &operator<<(std::ostream &os, const MemoryEstimate &estimate);
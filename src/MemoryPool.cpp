@@ -0,0 +1,188 @@
+#include "MemoryPool.h"
+
+#include <algorithm>
+
+#include <HalideRuntime.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+// Every block starts with a header recording its size class. The header is
+// as large as the strictest alignment Halide asks for, so the pointer handed
+// to the pipeline stays aligned.
+constexpr size_t kHeaderSize = 128;
+
+// Granularity of the smallest size classes.
+constexpr size_t kPageSize = 4096;
+
+// Blocks at least this large are advised to use transparent huge pages.
+constexpr size_t kHugePageSize = 2 << 20;
+
+struct BlockHeader {
+  size_t size_class;
+};
+
+MemoryPool *InstalledPool = nullptr;
+halide_malloc_t PreviousMalloc = nullptr;
+halide_free_t PreviousFree = nullptr;
+
+} // namespace
+
+MemoryPool::MemoryPool(bool use_huge_pages) : UseHugePages(use_huge_pages) {}
+
+MemoryPool::~MemoryPool() {
+  if (InstalledPool == this) {
+    Uninstall();
+  }
+  Trim();
+}
+
+/*
+ * SizeClass -- Rounds a request up to the next class. Classes are spaced at
+ * 1/8 of the enclosing power of two (but never finer than a page), which
+ * bounds the internal waste at 12.5% while keeping same-sized requests from
+ * consecutive bursts in the same class.
+ */
+size_t MemoryPool::SizeClass(size_t size) {
+  size_t pow2 = kPageSize;
+  while (pow2 < size) {
+    pow2 <<= 1;
+  }
+  const size_t granule = std::max(kPageSize, pow2 / 8);
+  return (size + granule - 1) / granule * granule;
+}
+
+size_t MemoryPool::BlockSize(size_t size) {
+  return SizeClass(size + kHeaderSize);
+}
+
+void *MemoryPool::MapBlock(size_t bytes) const {
+#ifdef _WIN32
+  return _aligned_malloc(bytes, kPageSize);
+#else
+  void *block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED) {
+    return nullptr;
+  }
+#ifdef MADV_HUGEPAGE
+  if (UseHugePages && bytes >= kHugePageSize) {
+    madvise(block, bytes, MADV_HUGEPAGE);
+  }
+#endif
+  return block;
+#endif
+}
+
+void MemoryPool::UnmapBlock(void *block, size_t bytes) {
+#ifdef _WIN32
+  (void)bytes;
+  _aligned_free(block);
+#else
+  munmap(block, bytes);
+#endif
+}
+
+void *MemoryPool::Allocate(size_t size) {
+  const size_t size_class = BlockSize(size);
+
+  void *block = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto it = FreeLists.find(size_class);
+    if (it != FreeLists.end() && !it->second.empty()) {
+      block = it->second.back();
+      it->second.pop_back();
+    }
+    BytesInUse += size_class;
+    HighWaterMark = std::max(HighWaterMark, BytesInUse);
+  }
+
+  if (block == nullptr) {
+    block = MapBlock(size_class);
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (block == nullptr) {
+      BytesInUse -= size_class;
+      return nullptr;
+    }
+    BytesReserved += size_class;
+  }
+
+  static_cast<BlockHeader *>(block)->size_class = size_class;
+  return static_cast<char *>(block) + kHeaderSize;
+}
+
+void MemoryPool::Free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  void *block = static_cast<char *>(ptr) - kHeaderSize;
+  const size_t size_class = static_cast<BlockHeader *>(block)->size_class;
+
+  std::lock_guard<std::mutex> lock(Mutex);
+  BytesInUse -= size_class;
+  FreeLists[size_class].push_back(block);
+}
+
+void MemoryPool::Trim() {
+  std::lock_guard<std::mutex> lock(Mutex);
+  for (auto &[size_class, blocks] : FreeLists) {
+    for (void *block : blocks) {
+      UnmapBlock(block, size_class);
+      BytesReserved -= size_class;
+    }
+    blocks.clear();
+  }
+}
+
+void MemoryPool::Install() {
+  if (InstalledPool == nullptr) {
+    PreviousMalloc = halide_set_custom_malloc(&MemoryPool::HalideMalloc);
+    PreviousFree = halide_set_custom_free(&MemoryPool::HalideFree);
+  }
+  InstalledPool = this;
+}
+
+void MemoryPool::Uninstall() {
+  if (InstalledPool != this) {
+    return;
+  }
+  halide_set_custom_malloc(PreviousMalloc);
+  halide_set_custom_free(PreviousFree);
+  InstalledPool = nullptr;
+}
+
+size_t MemoryPool::GetHighWaterMark() const {
+  std::lock_guard<std::mutex> lock(Mutex);
+  return HighWaterMark;
+}
+
+size_t MemoryPool::GetBytesInUse() const {
+  std::lock_guard<std::mutex> lock(Mutex);
+  return BytesInUse;
+}
+
+size_t MemoryPool::GetBytesReserved() const {
+  std::lock_guard<std::mutex> lock(Mutex);
+  return BytesReserved;
+}
+
+void MemoryPool::ResetHighWaterMark() {
+  std::lock_guard<std::mutex> lock(Mutex);
+  HighWaterMark = BytesInUse;
+}
+
+void *MemoryPool::HalideMalloc(void *user_context, size_t size) {
+  (void)user_context;
+  return InstalledPool->Allocate(size);
+}
+
+void MemoryPool::HalideFree(void *user_context, void *ptr) {
+  (void)user_context;
+  InstalledPool->Free(ptr);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * MemoryPool -- Size-class allocator backing the Halide runtime's heap
+ * allocations. Blocks released by a pipeline are kept on per-class free lists
+ * and handed back to the next request of the same class, so consecutive bursts
+ * of the same resolution reuse the same pages instead of faulting in fresh
+ * memory and unmapping it again. Large blocks can optionally be backed by
+ * transparent huge pages.
+ */
+class MemoryPool {
+public:
+  explicit MemoryPool(bool use_huge_pages = false);
+
+  ~MemoryPool();
+
+  MemoryPool(const MemoryPool &) = delete;
+  MemoryPool &operator=(const MemoryPool &) = delete;
+
+  void *Allocate(size_t size);
+
+  void Free(void *ptr);
+
+  // Returns all cached (currently unused) blocks to the system.
+  void Trim();
+
+  // Routes halide_malloc/halide_free of all AOT pipelines through this pool.
+  void Install();
+
+  // Restores the allocator that was active before Install().
+  void Uninstall();
+
+  // Peak number of bytes handed out at the same time since construction or
+  // the last ResetHighWaterMark().
+  size_t GetHighWaterMark() const;
+
+  size_t GetBytesInUse() const;
+
+  // Bytes currently mapped by the pool, including cached free blocks.
+  size_t GetBytesReserved() const;
+
+  void ResetHighWaterMark();
+
+  // Bytes the pool sets aside for an allocation of 'size' bytes.
+  static size_t BlockSize(size_t size);
+
+private:
+  static size_t SizeClass(size_t size);
+
+  void *MapBlock(size_t bytes) const;
+
+  static void UnmapBlock(void *block, size_t bytes);
+
+  static void *HalideMalloc(void *user_context, size_t size);
+
+  static void HalideFree(void *user_context, void *ptr);
+
+  const bool UseHugePages;
+
+  mutable std::mutex Mutex;
+  std::unordered_map<size_t, std::vector<void *>> FreeLists;
+  size_t BytesInUse = 0;
+  size_t BytesReserved = 0;
+  size_t HighWaterMark = 0;
+};
@@ -0,0 +1,130 @@
+#include "MergedCache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Identifies the file format; bump the version when the layout of an entry
+// or the output of align_and_merge changes, so that stale entries are
+// recomputed.
+constexpr char kMagic[8] = {'H', 'D', 'R', 'P', 'M', 'R', 'G', '1'};
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+// 64-bit FNV-1a
+uint64_t Hash(uint64_t hash, const char *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+template <typename T> void WriteValue(std::ofstream &file, const T &value) {
+  file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> bool ReadValue(std::ifstream &file, T &value) {
+  return bool(file.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+} // namespace
+
+MergedCache::MergedCache(const std::string &dir) : Dir(dir) {
+  std::filesystem::create_directories(Dir);
+}
+
+std::string MergedCache::Key(const std::vector<std::string> &paths) {
+  uint64_t hash = kFnvOffset;
+  std::vector<char> chunk(1 << 20);
+  for (const auto &path : paths) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+    uint64_t size = 0;
+    while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0) {
+      hash = Hash(hash, chunk.data(), file.gcount());
+      size += file.gcount();
+    }
+    // The size separates the contents of consecutive files.
+    hash = Hash(hash, reinterpret_cast<const char *>(&size), sizeof(size));
+  }
+  std::ostringstream key;
+  key << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return key.str();
+}
+
+std::string MergedCache::EntryPath(const std::string &key) const {
+  return Dir + "/" + key + ".merged";
+}
+
+bool MergedCache::Load(const std::string &key,
+                       Halide::Runtime::Buffer<uint16_t> &merged,
+                       BurstMetadata &metadata) const {
+  std::ifstream file(EntryPath(key), std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  char magic[sizeof(kMagic)];
+  int32_t width, height, cfa_pattern;
+  BurstMetadata md;
+  if (!file.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+      !ReadValue(file, width) || !ReadValue(file, height) ||
+      !ReadValue(file, md.black_level) || !ReadValue(file, md.white_level) ||
+      !ReadValue(file, md.white_balance) || !ReadValue(file, cfa_pattern) ||
+      !ReadValue(file, md.color_correction) || width <= 0 || height <= 0) {
+    return false;
+  }
+  md.cfa_pattern = static_cast<CfaPattern>(cfa_pattern);
+
+  Halide::Runtime::Buffer<uint16_t> frame(width, height);
+  if (!file.read(reinterpret_cast<char *>(frame.data()),
+                 std::streamsize(width) * height * sizeof(uint16_t))) {
+    return false;
+  }
+  merged = frame;
+  metadata = md;
+  return true;
+}
+
+void MergedCache::Store(const std::string &key,
+                        const Halide::Runtime::Buffer<uint16_t> &merged,
+                        const BurstMetadata &metadata) const {
+  const std::string path = EntryPath(key);
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    const int32_t width = merged.width();
+    const int32_t height = merged.height();
+    file.write(kMagic, sizeof(kMagic));
+    WriteValue(file, width);
+    WriteValue(file, height);
+    WriteValue(file, metadata.black_level);
+    WriteValue(file, metadata.white_level);
+    WriteValue(file, metadata.white_balance);
+    WriteValue(file, static_cast<int32_t>(metadata.cfa_pattern));
+    WriteValue(file, metadata.color_correction);
+    // Rows of the output of align_and_merge are dense.
+    const int x_min = merged.dim(0).min();
+    for (int y = merged.dim(1).min(); y < merged.dim(1).min() + height; ++y) {
+      const uint16_t *row = &merged(x_min, y);
+      file.write(reinterpret_cast<const char *>(row),
+                 std::streamsize(width) * sizeof(uint16_t));
+    }
+    if (!file) {
+      throw std::runtime_error("Cannot write merged frame cache entry " +
+                               tmp_path);
+    }
+  }
+  // Readers see either the previous entry or the complete new one.
+  std::filesystem::rename(tmp_path, path);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+#include "BurstMetadata.h"
+
+/*
+ * MergedCache -- Directory of merged bayer frames, keyed by the contents of
+ * the input files they were merged from. Aligning and merging a burst does
+ * not depend on the tone mapping parameters, so a burst rendered again with
+ * another compression or gain is read back from the cache together with its
+ * metadata, and only finish_pipeline runs. Entries are written in the byte
+ * order of the host and are not meant to be shared between machines.
+ */
+class MergedCache {
+public:
+  // Creates 'dir' if it does not exist yet.
+  explicit MergedCache(const std::string &dir);
+
+  // Hash of the contents of 'paths', in order, as a hexadecimal string. The
+  // order matters since the first frame is the reference.
+  static std::string Key(const std::vector<std::string> &paths);
+
+  // Reads the entry for 'key' into 'merged' and 'metadata'. Returns false if
+  // there is no usable entry.
+  bool Load(const std::string &key, Halide::Runtime::Buffer<uint16_t> &merged,
+            BurstMetadata &metadata) const;
+
+  // Writes the entry for 'key', replacing any previous one atomically.
+  void Store(const std::string &key,
+             const Halide::Runtime::Buffer<uint16_t> &merged,
+             const BurstMetadata &metadata) const;
+
+private:
+  std::string EntryPath(const std::string &key) const;
+
+  std::string Dir;
+};
@@ -0,0 +1,134 @@
+#include "MipiRaw.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <unpack_raw10.h>
+#include <unpack_raw12.h>
+
+namespace {
+
+const std::unordered_map<std::string, CfaPattern> CFA_PATTERNS = {
+    {"RGGB", CfaPattern::CFA_RGGB},
+    {"GRBG", CfaPattern::CFA_GRBG},
+    {"BGGR", CfaPattern::CFA_BGGR},
+    {"GBRG", CfaPattern::CFA_GBRG}};
+
+template <typename T> T ReadValue(std::istringstream &values,
+                                  const std::string &key) {
+  T value;
+  if (!(values >> value)) {
+    throw std::invalid_argument("Missing or invalid value for '" + key +
+                                "' in MIPI sidecar");
+  }
+  return value;
+}
+
+} // namespace
+
+MipiFormat MipiFormat::ReadSidecar(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("Cannot open MIPI sidecar " + path);
+  }
+
+  MipiFormat format;
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream values(line);
+    std::string key;
+    if (!(values >> key)) {
+      continue;
+    }
+
+    BurstMetadata &metadata = format.metadata;
+    if (key == "width") {
+      format.width = ReadValue<int>(values, key);
+    } else if (key == "height") {
+      format.height = ReadValue<int>(values, key);
+    } else if (key == "bits") {
+      format.bits = ReadValue<int>(values, key);
+    } else if (key == "row_stride") {
+      format.row_stride = ReadValue<ptrdiff_t>(values, key);
+    } else if (key == "black_level") {
+      metadata.black_level = ReadValue<int>(values, key);
+    } else if (key == "white_level") {
+      metadata.white_level = ReadValue<int>(values, key);
+    } else if (key == "white_balance") {
+      metadata.white_balance.r = ReadValue<float>(values, key);
+      metadata.white_balance.g0 = ReadValue<float>(values, key);
+      metadata.white_balance.g1 = ReadValue<float>(values, key);
+      metadata.white_balance.b = ReadValue<float>(values, key);
+    } else if (key == "cfa_pattern") {
+      const auto name = ReadValue<std::string>(values, key);
+      const auto it = CFA_PATTERNS.find(name);
+      if (it == CFA_PATTERNS.end()) {
+        throw std::invalid_argument("Unsupported CFA pattern: " + name);
+      }
+      metadata.cfa_pattern = it->second;
+    } else if (key == "color_correction") {
+      for (float &value : metadata.color_correction) {
+        value = ReadValue<float>(values, key);
+      }
+    } else {
+      throw std::invalid_argument("Unknown key '" + key + "' in MIPI sidecar");
+    }
+  }
+
+  if (format.bits != 10 && format.bits != 12) {
+    throw std::invalid_argument("MIPI frames must have 10 or 12 bits");
+  }
+  const int pixels_per_group = format.bits == 10 ? 4 : 2;
+  if (format.width <= 0 || format.height <= 0 ||
+      format.width % pixels_per_group != 0) {
+    throw std::invalid_argument("Invalid MIPI frame size");
+  }
+  const ptrdiff_t packed_width = ptrdiff_t(format.width) * format.bits / 8;
+  if (format.row_stride == 0) {
+    format.row_stride = packed_width;
+  } else if (format.row_stride < packed_width) {
+    throw std::invalid_argument("MIPI row stride is smaller than a row");
+  }
+  return format;
+}
+
+MipiBurst::MipiBurst(const std::string &sidecar_path,
+                     const std::vector<std::string> &frame_paths)
+    : Format(MipiFormat::ReadSidecar(sidecar_path)) {
+  std::vector<std::unique_ptr<MappedFile>> files;
+  int num_frames = 0;
+  for (const auto &path : frame_paths) {
+    files.push_back(std::make_unique<MappedFile>(path));
+    const size_t size = files.back()->GetSize();
+    if (size % Format.FrameBytes() != 0) {
+      throw std::invalid_argument(path + " does not hold whole MIPI frames");
+    }
+    num_frames += static_cast<int>(size / Format.FrameBytes());
+  }
+  Frames = Halide::Runtime::Buffer<uint16_t>(Format.width, Format.height,
+                                             num_frames);
+
+  int first = 0;
+  for (const auto &file : files) {
+    const int count = static_cast<int>(file->GetSize() / Format.FrameBytes());
+    halide_dimension_t shape[3] = {
+        {0, static_cast<int32_t>(Format.row_stride), 1, 0},
+        {0, Format.height, static_cast<int32_t>(Format.row_stride), 0},
+        {0, count, static_cast<int32_t>(Format.FrameBytes()), 0}};
+    Halide::Runtime::Buffer<uint8_t> packed(
+        const_cast<uint8_t *>(static_cast<const uint8_t *>(file->GetData())),
+        3, shape);
+
+    auto unpacked = Frames.cropped(2, first, count);
+    unpacked.set_min(0, 0, 0);
+    if (Format.bits == 10) {
+      unpack_raw10(packed, unpacked);
+    } else {
+      unpack_raw12(packed, unpacked);
+    }
+    first += count;
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+#include "BurstMetadata.h"
+#include "MappedFile.h"
+
+/*
+ * MipiFormat -- Layout and metadata of MIPI CSI-2 packed frames, read from a
+ * sidecar text file with one "key value..." entry per line:
+ *
+ *   width 4032
+ *   height 3024
+ *   bits 10                      # 10 or 12
+ *   row_stride 5040              # bytes; optional, defaults to packed width
+ *   black_level 64
+ *   white_level 1023
+ *   white_balance 1.9 1 1 1.6    # r g0 g1 b
+ *   cfa_pattern RGGB             # RGGB, GRBG, BGGR or GBRG
+ *   color_correction 1 0 0 0 1 0 0 0 1
+ *
+ * Lines starting with '#' and text after '#' are ignored.
+ */
+struct MipiFormat {
+  int width = 0;
+  int height = 0;
+  int bits = 10;
+  ptrdiff_t row_stride = 0;
+  BurstMetadata metadata;
+
+  static MipiFormat ReadSidecar(const std::string &path);
+
+  ptrdiff_t FrameBytes() const { return row_stride * height; }
+};
+
+/*
+ * MipiBurst -- Burst of packed RAW10 or RAW12 frames, which LibRaw cannot
+ * read. Each file holds one or more frames back to back; files are mapped and
+ * unpacked with vectorized bit manipulation into the frames(x, y, n) buffer,
+ * in parallel across the rows and frames of a file.
+ */
+class MipiBurst {
+public:
+  MipiBurst(const std::string &sidecar_path,
+            const std::vector<std::string> &frame_paths);
+
+  int GetWidth() const { return Frames.width(); }
+
+  int GetHeight() const { return Frames.height(); }
+
+  const BurstMetadata &GetMetadata() const { return Format.metadata; }
+
+  const Halide::Runtime::Buffer<uint16_t> &GetFrames() const { return Frames; }
+
+private:
+  MipiFormat Format;
+  Halide::Runtime::Buffer<uint16_t> Frames;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * ParallelFor -- Calls body(i) for every i in [0, count), spread over one
+ * thread per hardware thread including the calling one. Returns once all calls
+ * have finished; the first exception thrown by any of them is then rethrown.
+ */
+inline void ParallelFor(int count, const std::function<void(int)> &body) {
+  const int num_threads = std::min<int>(
+      count, std::max(1u, std::thread::hardware_concurrency()));
+
+  std::atomic<int> next(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  const auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      try {
+        body(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
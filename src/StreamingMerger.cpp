@@ -0,0 +1,62 @@
+#include "StreamingMerger.h"
+
+#include <stdexcept>
+
+#include <merge_finalize.h>
+#include <merge_init.h>
+#include <merge_push.h>
+
+#include "AlignParams.h"
+
+StreamingMerger::StreamingMerger(
+    const Halide::Runtime::Buffer<uint16_t> &reference)
+    : Width(reference.width()), Height(reference.height()) {
+  if (reference.dimensions() != 2) {
+    throw std::invalid_argument(
+        "The reference of a streaming merge must be a 2-dimensional frame.");
+  }
+
+  Layer0 = Halide::Runtime::Buffer<uint16_t>(Width / 2, Height / 2);
+  Layer1 = Halide::Runtime::Buffer<uint16_t>(Width / 2 / DOWNSAMPLE_RATE,
+                                             Height / 2 / DOWNSAMPLE_RATE);
+  Layer2 = Halide::Runtime::Buffer<uint16_t>(
+      Width / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE,
+      Height / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE);
+
+  // merge_init, merge_push and merge_finalize are built with the tiles of the
+  // build-wide AlignParams, and reject an accumulator sized for others. Tiles
+  // overlap by half; the spatial merge reads from tile -1 up to the tile
+  // holding the last pixel.
+  const AlignParams params;
+  const int tiles_x = (Width - 1) / params.tile_size_2() + 2;
+  const int tiles_y = (Height - 1) / params.tile_size_2() + 2;
+  Accumulator = Halide::Runtime::Buffer<float>(
+      params.tile_size, params.tile_size, tiles_x, tiles_y);
+  Accumulator.set_min(0, 0, -1, -1);
+  WeightSum = Halide::Runtime::Buffer<float>(tiles_x, tiles_y);
+  WeightSum.set_min(-1, -1);
+
+  Halide::Runtime::Buffer<uint16_t> ref = reference;
+  merge_init(ref, Layer0, Layer1, Layer2, Accumulator, WeightSum);
+}
+
+void StreamingMerger::Push(const Halide::Runtime::Buffer<uint16_t> &frame) {
+  if (frame.dimensions() != 2 || frame.width() != Width ||
+      frame.height() != Height) {
+    throw std::invalid_argument(
+        "Frames of a streaming merge must match the size of the reference.");
+  }
+  // The sums are updated in place.
+  Halide::Runtime::Buffer<uint16_t> alt = frame;
+  merge_push(alt, Layer0, Layer1, Layer2, Accumulator, WeightSum, Accumulator,
+             WeightSum);
+  NumFrames++;
+}
+
+Halide::Runtime::Buffer<uint16_t> StreamingMerger::Finalize() const {
+  Halide::Runtime::Buffer<uint16_t> merged(Width, Height);
+  Halide::Runtime::Buffer<float> accumulator = Accumulator;
+  Halide::Runtime::Buffer<float> weight_sum = WeightSum;
+  merge_finalize(accumulator, weight_sum, merged);
+  return merged;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <HalideBuffer.h>
+
+/*
+ * StreamingMerger -- Aligns and merges a burst one frame at a time. The
+ * reference frame sets up its alignment pyramid and the running sums of the
+ * merge; every frame pushed afterwards is aligned against that pyramid and
+ * added to the sums, after which it is no longer needed. Memory does not grow
+ * with the number of frames, and frames can be pushed as they are decoded.
+ *
+ * The merged frame matches the output of align_and_merge, except for small
+ * differences in tiles along the border, where the reference pyramid is
+ * mirrored at each layer instead of at full resolution.
+ */
+class StreamingMerger {
+public:
+  explicit StreamingMerger(const Halide::Runtime::Buffer<uint16_t> &reference);
+
+  // Adds an alternate frame of the same size as the reference. The frame is
+  // not referenced after the call returns.
+  void Push(const Halide::Runtime::Buffer<uint16_t> &frame);
+
+  // Merged bayer frame of the reference and all frames pushed so far.
+  Halide::Runtime::Buffer<uint16_t> Finalize() const;
+
+  int GetWidth() const { return Width; }
+
+  int GetHeight() const { return Height; }
+
+  // Number of frames merged so far, including the reference
+  int GetNumFrames() const { return NumFrames; }
+
+private:
+  int Width;
+  int Height;
+  int NumFrames = 1;
+
+  // Alignment pyramid of the reference, finest layer first
+  Halide::Runtime::Buffer<uint16_t> Layer0;
+  Halide::Runtime::Buffer<uint16_t> Layer1;
+  Halide::Runtime::Buffer<uint16_t> Layer2;
+
+  // Running sums of the merge, as described in merge.h
+  Halide::Runtime::Buffer<float> Accumulator;
+  Halide::Runtime::Buffer<float> WeightSum;
+};
@@ -0,0 +1,69 @@
+#include "ZslRingBuffer.h"
+
+#include <stdexcept>
+
+#include <frame_pyramid.h>
+
+#include "AlignParams.h"
+
+ZslRingBuffer::ZslRingBuffer(int width, int height, int capacity)
+    : Width(width), Height(height), Capacity(capacity) {
+  if (width <= 0 || height <= 0 || capacity < 2) {
+    throw std::invalid_argument(
+        "A ring buffer must hold at least two frames of a positive size.");
+  }
+  Frames = Halide::Runtime::Buffer<uint16_t>(Width, Height, Capacity);
+  Layer0 = Halide::Runtime::Buffer<uint16_t>(Width / 2, Height / 2, Capacity);
+  Layer1 = Halide::Runtime::Buffer<uint16_t>(Width / 2 / DOWNSAMPLE_RATE,
+                                             Height / 2 / DOWNSAMPLE_RATE,
+                                             Capacity);
+  Layer2 = Halide::Runtime::Buffer<uint16_t>(
+      Width / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE,
+      Height / 2 / DOWNSAMPLE_RATE / DOWNSAMPLE_RATE, Capacity);
+}
+
+void ZslRingBuffer::Push(const Halide::Runtime::Buffer<uint16_t> &frame) {
+  if (frame.dimensions() != 2 || frame.width() != Width ||
+      frame.height() != Height) {
+    throw std::invalid_argument(
+        "Frames pushed to a ring buffer must match its frame size.");
+  }
+  Halide::Runtime::Buffer<uint16_t> slot = Frames.sliced(2, Next);
+  slot.copy_from(frame);
+  Commit();
+}
+
+void ZslRingBuffer::Push(const RawImage &raw) {
+  if (raw.GetWidth() != Width || raw.GetHeight() != Height) {
+    throw std::invalid_argument(
+        "Frames pushed to a ring buffer must match its frame size.");
+  }
+  Halide::Runtime::Buffer<uint16_t> slot = Frames.sliced(2, Next);
+  raw.CopyToBuffer(slot);
+  Commit();
+}
+
+void ZslRingBuffer::Commit() {
+  Halide::Runtime::Buffer<uint16_t> frame = Frames.sliced(2, Next);
+  Halide::Runtime::Buffer<uint16_t> layer_0 = Layer0.sliced(2, Next);
+  Halide::Runtime::Buffer<uint16_t> layer_1 = Layer1.sliced(2, Next);
+  Halide::Runtime::Buffer<uint16_t> layer_2 = Layer2.sliced(2, Next);
+  frame_pyramid(frame, layer_0, layer_1, layer_2);
+
+  Next = (Next + 1) % Capacity;
+  if (Count < Capacity) {
+    Count++;
+  }
+}
+
+std::vector<int> ZslRingBuffer::GetFrameMap(int count) const {
+  if (count < 2 || count > Count) {
+    throw std::invalid_argument(
+        "A burst from a ring buffer needs at least two buffered frames.");
+  }
+  std::vector<int> frame_map(count);
+  for (int i = 0; i < count; i++) {
+    frame_map[i] = (Next - 1 - i + Capacity) % Capacity;
+  }
+  return frame_map;
+}
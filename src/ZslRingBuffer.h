@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+
+#include <HalideBuffer.h>
+
+#include "InputSource.h"
+
+/*
+ * ZslRingBuffer -- Rolling buffer of the most recent frames of a capture, for
+ * zero shutter lag. Frames are copied into preallocated slots as they arrive,
+ * overwriting the oldest one, and the alignment pyramid of each frame is
+ * computed at that time. When the shutter is pressed, HdrPlusContext::Process
+ * only runs the alignment search, the merge and finish on the buffered frames.
+ *
+ * A ring buffer is not thread-safe; frames must not be pushed while a burst
+ * is being rendered from it.
+ */
+class ZslRingBuffer {
+public:
+  ZslRingBuffer(int width, int height, int capacity);
+
+  // Copies 'frame' into the slot of the oldest frame and computes its
+  // alignment pyramid.
+  void Push(const Halide::Runtime::Buffer<uint16_t> &frame);
+
+  void Push(const RawImage &raw);
+
+  // Slots of the 'count' most recent frames, newest first. The newest frame
+  // is the reference of a burst taken on shutter press.
+  std::vector<int> GetFrameMap(int count) const;
+
+  int GetWidth() const { return Width; }
+
+  int GetHeight() const { return Height; }
+
+  int GetCapacity() const { return Capacity; }
+
+  // Number of frames buffered so far, at most the capacity
+  int GetCount() const { return Count; }
+
+  // Frames and alignment layers, indexed by slot in the last dimension
+  const Halide::Runtime::Buffer<uint16_t> &GetFrames() const { return Frames; }
+
+  const Halide::Runtime::Buffer<uint16_t> &GetLayer0() const { return Layer0; }
+
+  const Halide::Runtime::Buffer<uint16_t> &GetLayer1() const { return Layer1; }
+
+  const Halide::Runtime::Buffer<uint16_t> &GetLayer2() const { return Layer2; }
+
+private:
+  // Computes the pyramid of the frame just copied into slot Next and makes it
+  // the newest frame.
+  void Commit();
+
+  int Width;
+  int Height;
+  int Capacity;
+  int Next = 0; // slot the next frame is written to
+  int Count = 0;
+
+  Halide::Runtime::Buffer<uint16_t> Frames;
+  Halide::Runtime::Buffer<uint16_t> Layer0;
+  Halide::Runtime::Buffer<uint16_t> Layer1;
+  Halide::Runtime::Buffer<uint16_t> Layer2;
+};
@@ -3,25 +3,53 @@
 #include "Halide.h"
 #include "Point.h"
 #include "util.h"
+#include <algorithm>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace Halide;
 using namespace Halide::ConciseCasts;
 
 /*
- * align_layer -- determines the best offset for tiles of the image at a given
- * resolution provided the offsets for the layer above.
+ * quantize_layer -- Keeps the 8 most significant bits of a u16 pyramid layer
+ * whose values do not exceed white_level, for the 8-bit coarse search.
  */
-Func align_layer(Func layer, Func prev_alignment, Point prev_min,
-                 Point prev_max) {
+Func quantize_layer(Func layer, Halide::Expr white_level) {
 
-  Func scores(layer.name() + "_scores");
-  Func alignment(layer.name() + "_alignment");
+  Func output(layer.name() + "_u8");
+
+  Var x, y;
+
+  Expr bits = 16 - i32(count_leading_zeros(u16(white_level)));
+  Expr shift = u16(max(bits - 8, 0));
+
+  output(x, y, _) = u8_sat(layer(x, y, _) >> shift);
+
+  return output;
+}
+
+/*
+ * align_layer -- determines the best offset for tiles of the alternate frames
+ * at a given resolution provided the offsets for the layer above. ref_layer is
+ * the layer of the reference frame, alt_layer the same layer of all frames.
+ * With a white_level, the search runs on 8-bit copies of both layers.
+ */
+Func align_layer(Func ref_layer, Func alt_layer, Func prev_alignment,
+                 Point prev_min, Point prev_max, const AlignParams &params,
+                 Expr white_level) {
+
+  Func scores(alt_layer.name() + "_scores");
+  Func alignment(alt_layer.name() + "_alignment");
 
   Var xi, yi, tx, ty, n;
-  RDom r0(0, 16, 0, 16); // reduction over pixels in tile
-  RDom r1(-4, 8, -4, 8); // reduction over search region; extent clipped to 8
-                         // for SIMD vectorization
+  const int t_size_2 = params.tile_size_2();
+  const int radius = params.search_radius;
+  RDom r0(0, t_size_2, 0, t_size_2); // reduction over pixels in tile
+
+  // reduction over search region; extent clipped to an even number for SIMD
+  // vectorization
+  RDom r1(-radius, 2 * radius, -radius, 2 * radius);
 
   // offset from the alignment of the previous layer, scaled to this layer.
   // Clamp to bound the amount of memory Halide allocates for the current
@@ -33,34 +61,78 @@ Func align_layer(Func layer, Func prev_alignment, Point prev_min,
 
   // indices into layer at a specific tile indices and offsets
 
-  Expr x0 = idx_layer(tx, r0.x);
-  Expr y0 = idx_layer(ty, r0.y);
+  Expr x0 = idx_layer(tx, r0.x, params);
+  Expr y0 = idx_layer(ty, r0.y, params);
 
   Expr x = x0 + prev_offset.x + xi;
   Expr y = y0 + prev_offset.y + yi;
 
+  // layers the search reads, quantized to 8 bits with a white level
+
+  const bool quantized = white_level.defined();
+  Func ref_search = ref_layer;
+  Func alt_search = alt_layer;
+  if (quantized) {
+    ref_search = quantize_layer(ref_layer, white_level);
+    alt_search = quantize_layer(alt_layer, white_level);
+  }
+
   // values and L1 distance between reference and alternate layers at specific
   // pixel
 
-  Expr ref_val = layer(x0, y0, 0);
-  Expr alt_val = layer(x, y, n);
-
-  Expr dist = abs(i32(ref_val) - i32(alt_val));
+  Expr ref_val = ref_search(x0, y0);
+  Expr alt_val = alt_search(x, y, n);
 
   // sum of L1 distances over each pixel in a tile, for the offset specified by
-  // xi, yi
+  // xi, yi. On quantized layers the 8-bit absolute differences are widened
+  // while summed, which maps to sum of absolute differences instructions.
 
-  scores(xi, yi, tx, ty, n) = sum(dist);
+  if (quantized) {
+    scores(xi, yi, tx, ty, n) = u32(0);
+    scores(xi, yi, tx, ty, n) += u32(absd(ref_val, alt_val));
+  } else {
+    Expr dist = abs(i32(ref_val) - i32(alt_val));
 
-  // alignment offset for each tile (offset where score is minimum)
+    scores(xi, yi, tx, ty, n) = sum(dist);
+  }
 
-  alignment(tx, ty, n) = P(argmin(scores(r1.x, r1.y, tx, ty, n))) + prev_offset;
+  // alignment offset for each tile (offset where score is minimum). The score
+  // and the index of the offset in the search region are packed into one u32
+  // key, score in the high bits, so the search is a plain minimum that
+  // vectorizes across tiles. Ties resolve to the lowest index, as with argmin.
+  // AlignParams::Validate ensures the largest score fits the remaining bits.
+
+  const int search_size = 2 * radius;
+  const int index_bits = params.search_index_bits();
+  const uint32_t index_mask = (uint32_t(1) << index_bits) - 1;
+
+  Expr index = u32((r1.y + radius) * search_size + (r1.x + radius));
+  Expr score = u32(scores(r1.x, r1.y, tx, ty, n));
+
+  Func keys(alt_layer.name() + "_keys");
+  keys(tx, ty, n) = minimum((score << u32(index_bits)) | index);
+
+  Expr best = i32(keys(tx, ty, n) & Expr(index_mask));
+
+  alignment(tx, ty, n) =
+      P(best % search_size - radius, best / search_size - radius) +
+      prev_offset;
 
   ///////////////////////////////////////////////////////////////////////////
   // schedule
   ///////////////////////////////////////////////////////////////////////////
 
-  scores.compute_at(alignment, tx).vectorize(xi, 8);
+  scores.compute_at(keys, tx).vectorize(xi, std::min(search_size, 8));
+  if (quantized) {
+    scores.update().atomic().vectorize(r0.x);
+
+    // The 8-bit layers are produced for each row of tiles as it is searched,
+    // rather than stored for the whole burst.
+    ref_search.compute_at(alignment, ty).vectorize(ref_search.args()[0], 32);
+    alt_search.compute_at(alignment, ty).vectorize(alt_search.args()[0], 32);
+  }
+
+  keys.compute_at(alignment, ty).vectorize(tx, 16);
 
   alignment.compute_root().parallel(ty).vectorize(tx, 16);
 
@@ -68,18 +140,11 @@ Func align_layer(Func layer, Func prev_alignment, Point prev_min,
 }
 
 /*
- * align -- Aligns multiple raw RGGB frames of a scene in T_SIZE x T_SIZE tiles
- * which overlap by T_SIZE_2 in each dimension. align(imgs)(tile_x, tile_y, n)
- * is a point representing the x and y offset for a tile in layer n that most
- * closely matches that tile in the reference (relative to the reference tile's
- * location)
+ * align_pyramid -- Builds the downsampled layers of the alignment pyramid of
+ * every frame.
  */
-Func align(const Halide::Func imgs, Halide::Expr width, Halide::Expr height) {
-
-  Func alignment_3("layer_3_alignment");
-  Func alignment("alignment");
-
-  Var tx, ty, n;
+std::vector<Func> align_pyramid(const Halide::Func imgs, Halide::Expr width,
+                                Halide::Expr height) {
 
   // mirror input with overlapping edges
 
@@ -92,10 +157,54 @@ Func align(const Halide::Func imgs, Halide::Expr width, Halide::Expr height) {
   Func layer_1 = gauss_down4(layer_0, "layer_1");
   Func layer_2 = gauss_down4(layer_1, "layer_2");
 
+  return {layer_0, layer_1, layer_2};
+}
+
+/*
+ * align_pyramid_layer -- Computes one coarse layer of align_pyramid, with each
+ * finer layer computed per row of the layer below it.
+ */
+Func align_pyramid_layer(const Halide::Func imgs, Halide::Expr width,
+                         Halide::Expr height, int layer) {
+  if (layer < 1 || layer > 2) {
+    throw std::invalid_argument(
+        "align_pyramid_layer computes layer 1 or 2 of the pyramid");
+  }
+  std::vector<Func> layers = align_pyramid(imgs, width, height);
+
+  // the rows of a layer read 5 rows of the layer above it, so computing the
+  // finer layers per row recomputes a quarter of them instead of storing them
+
+  for (int i = 0; i < layer; i++) {
+    Func coarser = layers[i + 1];
+    layers[i].compute_at(coarser, coarser.args()[1]);
+  }
+
+  return layers[layer];
+}
+
+/*
+ * align_from_layers -- Aligns the frames whose pyramid layers are alt_layers
+ * to the reference frame whose pyramid layers are ref_layers, in tiles of
+ * params.tile_size which overlap by half in each dimension. When coarse is
+ * set, the search on the finest layer of the pyramid is skipped and the
+ * offsets found on the layer above are upsampled instead.
+ */
+Func align_from_layers(const std::vector<Func> &ref_layers,
+                       const std::vector<Func> &alt_layers, Halide::Expr width,
+                       Halide::Expr height, bool coarse,
+                       const AlignParams &params, Halide::Expr white_level) {
+
+  Func alignment_3("layer_3_alignment");
+  Func alignment("alignment");
+
+  Var tx, ty, n;
+
   // min and max search regions
 
-  Point min_search = P(-4, -4);
-  Point max_search = P(3, 3);
+  const int radius = params.search_radius;
+  Point min_search = P(-radius, -radius);
+  Point max_search = P(radius - 1, radius - 1);
 
   Point min_3 = P(0, 0);
   Point min_2 = DOWNSAMPLE_RATE * min_3 + min_search;
@@ -109,21 +218,47 @@ Func align(const Halide::Func imgs, Halide::Expr width, Halide::Expr height) {
 
   alignment_3(tx, ty, n) = P(0, 0);
 
+  params.Validate();
+
+  // white level the coarse layers are quantized with, if at all
+
+  Expr coarse_white_level;
+  if (params.coarse_u8) {
+    if (!white_level.defined()) {
+      throw std::invalid_argument(
+          "coarse_u8 alignment requires the white level of the frames");
+    }
+    coarse_white_level = white_level;
+  }
+
   // hierarchal alignment functions
 
-  Func alignment_2 = align_layer(layer_2, alignment_3, min_3, max_3);
-  Func alignment_1 = align_layer(layer_1, alignment_2, min_2, max_2);
-  Func alignment_0 = align_layer(layer_0, alignment_1, min_1, max_1);
+  Func alignment_2 =
+      align_layer(ref_layers[2], alt_layers[2], alignment_3, min_3, max_3,
+                  params, coarse_white_level);
+  Func alignment_1 =
+      align_layer(ref_layers[1], alt_layers[1], alignment_2, min_2, max_2,
+                  params, coarse_white_level);
 
   // number of tiles in the x and y dimensions
 
-  Expr num_tx = width / T_SIZE_2 - 1;
-  Expr num_ty = height / T_SIZE_2 - 1;
+  Expr num_tx = width / params.tile_size_2() - 1;
+  Expr num_ty = height / params.tile_size_2() - 1;
 
   // final alignment offsets for the original mosaic image; tiles outside of the
   // bounds use the nearest alignment offset
 
-  alignment(tx, ty, n) = 2 * P(alignment_0(tx, ty, n));
+  if (coarse) {
+    alignment(tx, ty, n) =
+        2 * DOWNSAMPLE_RATE *
+        clamp(P(alignment_1(prev_tile(tx), prev_tile(ty), n)), min_1, max_1);
+  } else {
+    Func alignment_0 =
+        align_layer(ref_layers[0], alt_layers[0], alignment_1, min_1, max_1,
+                    params, Expr());
+
+    alignment(tx, ty, n) = 2 * P(alignment_0(tx, ty, n));
+  }
 
   Func alignment_repeat = BoundaryConditions::repeat_edge(
       alignment, {Range(0, num_tx), Range(0, num_ty)});
@@ -131,7 +266,162 @@ Func align(const Halide::Func imgs, Halide::Expr width, Halide::Expr height) {
   return alignment_repeat;
 }
 
+/*
+ * align_levels -- Aligns multiple raw RGGB frames of a scene to the first one,
+ * computing the pyramids of all of them.
+ */
+Func align_levels(const Halide::Func imgs, Halide::Expr width,
+                  Halide::Expr height, bool coarse, const AlignParams &params,
+                  Halide::Expr white_level) {
+  std::vector<Func> layers = align_pyramid(imgs, width, height);
+
+  // the reference is frame 0 of every layer
+
+  std::vector<Func> ref_layers;
+  for (Func layer : layers) {
+    Func ref_layer(layer.name() + "_ref");
+    Var x, y;
+    ref_layer(x, y) = layer(x, y, 0);
+    ref_layers.push_back(ref_layer);
+  }
+
+  return align_from_layers(ref_layers, layers, width, height, coarse, params,
+                           white_level);
+}
+
+/*
+ * align -- Aligns multiple raw RGGB frames of a scene in tiles of
+ * params.tile_size which overlap by half in each dimension.
+ * align(imgs)(tile_x, tile_y, n) is a point representing the x and y offset
+ * for a tile in layer n that most closely matches that tile in the reference
+ * (relative to the reference tile's location)
+ */
+Func align(const Halide::Func imgs, Halide::Expr width, Halide::Expr height,
+           const AlignParams &params, Halide::Expr white_level) {
+  return align_levels(imgs, width, height, false, params, white_level);
+}
+
+/*
+ * align_coarse -- Aligns frames like align, but without the full search on the
+ * finest layer of the pyramid. Offsets are accurate to DOWNSAMPLE_RATE pixels
+ * of the first downsampled layer, which is enough for low resolution output.
+ */
+Func align_coarse(const Halide::Func imgs, Halide::Expr width,
+                  Halide::Expr height, const AlignParams &params,
+                  Halide::Expr white_level) {
+  return align_levels(imgs, width, height, true, params, white_level);
+}
+
 Halide::Func align(Halide::Buffer<uint16_t> imgs) {
   Halide::Func imgs_function(imgs);
   return align(imgs_function, imgs.width(), imgs.height());
 }
+
+/*
+ * gradient_energy -- Sums the squared horizontal and vertical central
+ * differences over the interior of each frame, normalized by its area. The
+ * interior of a layer narrower or shorter than 3 pixels, e.g. of a small crop,
+ * is its first row or column, with reads clamped to the layer.
+ */
+Func gradient_energy(Func layer, Expr width, Expr height) {
+
+  Func energy("gradient_energy");
+
+  Var n;
+  Expr inner_width = max(width - 2, 1);
+  Expr inner_height = max(height - 2, 1);
+  RDom r(1, inner_width, 1, inner_height);
+
+  Expr x = min(r.x, width - 1);
+  Expr y = min(r.y, height - 1);
+  Expr x_prev = max(r.x - 1, 0);
+  Expr x_next = min(r.x + 1, width - 1);
+  Expr y_prev = max(r.y - 1, 0);
+  Expr y_next = min(r.y + 1, height - 1);
+
+  Expr dx = f32(layer(x_next, y, n)) - f32(layer(x_prev, y, n));
+  Expr dy = f32(layer(x, y_next, n)) - f32(layer(x, y_prev, n));
+
+  energy(n) = sum(dx * dx + dy * dy) / (f32(inner_width) * f32(inner_height));
+
+  return energy;
+}
+
+/*
+ * align_static -- Zero offsets for every tile.
+ */
+Func align_static() {
+
+  Func alignment("static_alignment");
+
+  Var tx, ty, n;
+
+  alignment(tx, ty, n) = P(0, 0);
+
+  return alignment;
+}
+
+/*
+ * tile_residual -- Averages the L1 distance between the tiles of the
+ * reference layer and those of the alternate layers at the given alignment
+ * offsets, over all tiles of a width x height layer.
+ */
+Func tile_residual(Func ref_layer, Func alt_layer, Func alignment, Expr width,
+                   Expr height, const AlignParams &params, std::string name) {
+
+  Func residual(name);
+
+  Var n;
+
+  // number of tiles in the layer; tiles overlap by half
+
+  const int t_size_2 = params.tile_size_2();
+  Expr num_tx = max(1, width / (t_size_2 / 2) - 1);
+  Expr num_ty = max(1, height / (t_size_2 / 2) - 1);
+
+  // reduction over pixels within tiles, then over tiles
+  RDom r(0, t_size_2, 0, t_size_2, 0, num_tx, 0, num_ty);
+
+  Point offset = P(alignment(r[2], r[3], n));
+
+  Expr x0 = idx_layer(r[2], r[0], params);
+  Expr y0 = idx_layer(r[3], r[1], params);
+
+  Expr ref_val = ref_layer(x0, y0);
+  Expr alt_val = alt_layer(x0 + offset.x, y0 + offset.y, n);
+
+  residual(n) = sum(abs(f32(ref_val) - f32(alt_val))) /
+                (f32(num_tx) * f32(num_ty) * f32(t_size_2 * t_size_2));
+
+  return residual;
+}
+
+/*
+ * coarse_residual -- Runs the tile search of align_layer on one layer with no
+ * prior offsets and averages the L1 distance of the best offset of every tile.
+ */
+Func coarse_residual(Func ref_layer, Func alt_layer, Expr width, Expr height,
+                     const AlignParams &params) {
+
+  Func alignment_prev("coarse_residual_prev_alignment");
+
+  Var tx, ty, n;
+
+  alignment_prev(tx, ty, n) = P(0, 0);
+
+  Func alignment =
+      align_layer(ref_layer, alt_layer, alignment_prev, P(0, 0), P(0, 0),
+                  params, Expr());
+
+  return tile_residual(ref_layer, alt_layer, alignment, width, height, params,
+                       "coarse_residual");
+}
+
+/*
+ * static_residual -- Averages the L1 distance of every tile at offset (0, 0).
+ */
+Func static_residual(Func ref_layer, Func alt_layer, Expr width, Expr height,
+                     const AlignParams &params) {
+  return tile_residual(ref_layer, alt_layer, align_static(), width, height,
+                       params, "static_residual");
+}
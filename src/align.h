@@ -1,21 +1,10 @@
 #pragma once
 
-#define T_SIZE 32 // Size of a tile in the bayer mosaiced image
-#define T_SIZE_2                                                               \
-  16 // Half of T_SIZE and the size of a tile throughout the alignment pyramid
-
-#define MIN_OFFSET                                                             \
-  -168 // Min total alignment (based on three levels and downsampling by 4)
-#define MAX_OFFSET                                                             \
-  126 // Max total alignment. Differs from MIN_OFFSET because total search range
-      // is 8 for better vectorization
-
-#define DOWNSAMPLE_RATE                                                        \
-  4 // Rate at which layers of the alignment pyramid are downsampled relative to
-    // each other
-
+#include "AlignParams.h"
 #include "Halide.h"
 
+#include <vector>
+
 /*
  * prev_tile -- Returns an index to the nearest tile in the previous level of
  * the pyramid.
@@ -28,49 +17,140 @@ inline Halide::Expr prev_tile(Halide::Expr t) {
  * tile_0 -- Returns the upper (for y input) or left (for x input) tile that an
  * image index touches.
  */
-inline Halide::Expr tile_0(Halide::Expr e) { return e / T_SIZE_2 - 1; }
+inline Halide::Expr tile_0(Halide::Expr e, const AlignParams &params) {
+  return e / params.tile_size_2() - 1;
+}
 
 /*
  * tile_1 -- Returns the lower (for y input) or right (for x input) tile that an
  * image index touches.
  */
-inline Halide::Expr tile_1(Halide::Expr e) { return e / T_SIZE_2; }
+inline Halide::Expr tile_1(Halide::Expr e, const AlignParams &params) {
+  return e / params.tile_size_2();
+}
 
 /*
  * idx_0 -- Returns the inner index into the upper (for y input) or left (for x
  * input) tile that an image index touches.
  */
-inline Halide::Expr idx_0(Halide::Expr e) { return e % T_SIZE_2 + T_SIZE_2; }
+inline Halide::Expr idx_0(Halide::Expr e, const AlignParams &params) {
+  return e % params.tile_size_2() + params.tile_size_2();
+}
 
 /*
  * idx_1 -- Returns the inner index into the lower (for y input) or right (for x
  * input) tile that an image index touches.
  */
-inline Halide::Expr idx_1(Halide::Expr e) { return e % T_SIZE_2; }
+inline Halide::Expr idx_1(Halide::Expr e, const AlignParams &params) {
+  return e % params.tile_size_2();
+}
 
 /*
  * idx_im -- Returns the image index given a tile and the inner index into the
  * tile.
  */
-inline Halide::Expr idx_im(Halide::Expr t, Halide::Expr i) {
-  return t * T_SIZE_2 + i;
+inline Halide::Expr idx_im(Halide::Expr t, Halide::Expr i,
+                           const AlignParams &params) {
+  return t * params.tile_size_2() + i;
 }
 
 /*
  * idx_layer -- Returns the image index given a tile and the inner index into
  * the tile.
  */
-inline Halide::Expr idx_layer(Halide::Expr t, Halide::Expr i) {
-  return t * T_SIZE_2 / 2 + i;
+inline Halide::Expr idx_layer(Halide::Expr t, Halide::Expr i,
+                              const AlignParams &params) {
+  return t * params.tile_size_2() / 2 + i;
 }
 
 /*
- * align -- Aligns multiple raw RGGB frames of a scene in T_SIZE x T_SIZE tiles
- * which overlap by T_SIZE_2 in each dimension. align(imgs)(tile_x, tile_y, n)
- * is a point representing the x and y offset for a tile in layer n that most
- * closely matches that tile in the reference (relative to the reference tile's
- * location)
+ * align -- Aligns multiple raw RGGB frames of a scene in tiles of
+ * params.tile_size which overlap by half in each dimension.
+ * align(imgs)(tile_x, tile_y, n) is a point representing the x and y offset
+ * for a tile in layer n that most closely matches that tile in the reference
+ * (relative to the reference tile's location). white_level, the largest value
+ * of the frames, is only needed with params.coarse_u8.
  */
 Halide::Func align(Halide::Buffer<uint16_t> imgs);
 Halide::Func align(const Halide::Func imgs, Halide::Expr width,
-                   Halide::Expr height);
+                   Halide::Expr height,
+                   const AlignParams &params = AlignParams(),
+                   Halide::Expr white_level = Halide::Expr());
+
+/*
+ * align_pyramid -- Builds the downsampled layers of the alignment pyramid of
+ * frames imgs(x, y, n), finest first: layer 0 is averaged down by 2, each
+ * following layer is blurred and downsampled by DOWNSAMPLE_RATE. Frames are
+ * mirrored past width and height.
+ */
+std::vector<Halide::Func> align_pyramid(const Halide::Func imgs,
+                                        Halide::Expr width,
+                                        Halide::Expr height);
+
+/*
+ * align_pyramid_layer -- Layer 'layer' (1 or 2) of the pyramids built by
+ * align_pyramid, computed alone: the finer layers are only computed in strips
+ * of a few rows for every row of it, so no full size intermediate is kept.
+ * For measuring a burst on a coarse layer without building its pyramids.
+ */
+Halide::Func align_pyramid_layer(const Halide::Func imgs, Halide::Expr width,
+                                 Halide::Expr height, int layer);
+
+/*
+ * align_from_layers -- Aligns frames like align, given the pyramid layers of
+ * the reference frame as ref_layers(x, y) and those of the frames to align as
+ * alt_layers(x, y, n), both as built by align_pyramid. This lets a reference
+ * pyramid be computed once and reused for frames that arrive later.
+ */
+Halide::Func align_from_layers(const std::vector<Halide::Func> &ref_layers,
+                               const std::vector<Halide::Func> &alt_layers,
+                               Halide::Expr width, Halide::Expr height,
+                               bool coarse = false,
+                               const AlignParams &params = AlignParams(),
+                               Halide::Expr white_level = Halide::Expr());
+
+/*
+ * align_coarse -- Aligns frames like align, but skips the search on the finest
+ * layer of the pyramid and upsamples the offsets of the layer above instead.
+ * Much cheaper, with offsets only accurate enough for low resolution output.
+ */
+Halide::Func align_coarse(const Halide::Func imgs, Halide::Expr width,
+                          Halide::Expr height,
+                          const AlignParams &params = AlignParams(),
+                          Halide::Expr white_level = Halide::Expr());
+
+/*
+ * gradient_energy -- Mean squared central difference of each frame of
+ * layer(x, y, n), a width x height layer of the alignment pyramid. Blurry
+ * frames have less energy, so the sharpest frame of a burst is the one with
+ * the most.
+ */
+Halide::Func gradient_energy(Halide::Func layer, Halide::Expr width,
+                             Halide::Expr height);
+
+/*
+ * align_static -- Alignment of a static burst, such as one shot on a tripod:
+ * every tile of every frame keeps offset (0, 0) and no search is run.
+ */
+Halide::Func align_static();
+
+/*
+ * coarse_residual -- Aligns the frames alt_layer(x, y, n) to the reference
+ * ref_layer(x, y) on a coarse layer of the pyramid alone (layer 2 in
+ * practice) and returns the mean absolute difference per pixel that remains
+ * after alignment, for every frame. width and height are those of the layer.
+ * Frames that cannot be aligned, e.g. from hand shake or a flash, stand out
+ * with a large residual before any work is done at full resolution.
+ */
+Halide::Func coarse_residual(Halide::Func ref_layer, Halide::Func alt_layer,
+                             Halide::Expr width, Halide::Expr height,
+                             const AlignParams &params = AlignParams());
+
+/*
+ * static_residual -- Like coarse_residual, but with every tile at offset
+ * (0, 0). When the search of coarse_residual does not improve on it, the
+ * scene did not move and the burst can be merged with align_static.
+ */
+Halide::Func static_residual(Halide::Func ref_layer, Halide::Func alt_layer,
+                             Halide::Expr width, Halide::Expr height,
+                             const AlignParams &params = AlignParams());
@@ -8,15 +8,22 @@ namespace {
 
 class StackFrames : public Halide::Generator<StackFrames> {
 public:
+  // Alignment tiles and search, see AlignParams
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+
   // 'inputs' is really a series of raw 2d frames; extent[2] specifies the count
   Input<Halide::Buffer<uint16_t>> inputs{"inputs", 3};
   // Merged buffer
   Output<Halide::Buffer<uint16_t>> output{"output", 2};
 
   void generate() {
-    Func alignment = align(inputs, inputs.width(), inputs.height());
+    const AlignParams params{tile_size.value(), search_radius.value()};
+    params.Validate();
+    Func alignment = align(inputs, inputs.width(), inputs.height(), params);
     Func merged = merge(inputs, inputs.width(), inputs.height(),
-                        inputs.dim(2).extent(), alignment);
+                        inputs.dim(2).extent(), alignment, params);
     output = merged;
   }
 };
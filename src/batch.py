@@ -15,6 +15,11 @@ params = [(4.2, 1.05), (3.8, 1.30), (3.9, 1.10), (3.8, 1.10), (5.0, 1.00), (3.8,
 
 skip = []
 
+# merged frames are cached here, so re-running with new (comp, gain) pairs only
+# pays for finishing
+
+cache = "/outputs/cache"
+
 commands = []
 
 for burst in xrange(38):
@@ -27,6 +32,8 @@ for burst in xrange(38):
 	
 	command += (" -c " + str(comp) + " -g " + str(gain))
 
+	command += (" --cache " + cache)
+
 	command += " /afs/cs/academic/class/15769-f16/project/tebrooks/raws/"
 
 	command += (" /outputs/output" + str(burst) + ".png")
@@ -27,7 +27,8 @@ Func black_white_level(Func input, const Expr bp, const Expr wp) {
 /*
  * white_balance -- Corrects white-balance of a mosaicked image based on input
  * color multipliers. Note that the two green channels in the bayer pattern
- * are white-balanced separately.
+ * are white-balanced separately. The output is a pure function of position,
+ * so only the region required by later stages is computed.
  */
 Func white_balance(Func input, Expr width, Expr height,
                    const CompiletimeWhiteBalance &wb) {
@@ -35,18 +36,14 @@ Func white_balance(Func input, Expr width, Expr height,
   Func output("white_balance_output");
 
   Var x, y;
-  RDom r(0, width / 2, 0, height / 2);
 
-  output(x, y) = u16(0);
+  Expr R_row = y % 2 == 0;
+  Expr R_col = x % 2 == 0;
 
-  output(r.x * 2, r.y * 2) =
-      u16_sat(wb.r * f32(input(r.x * 2, r.y * 2))); // red
-  output(r.x * 2 + 1, r.y * 2) =
-      u16_sat(wb.g0 * f32(input(r.x * 2 + 1, r.y * 2))); // green 0
-  output(r.x * 2, r.y * 2 + 1) =
-      u16_sat(wb.g1 * f32(input(r.x * 2, r.y * 2 + 1))); // green 1
-  output(r.x * 2 + 1, r.y * 2 + 1) =
-      u16_sat(wb.b * f32(input(r.x * 2 + 1, r.y * 2 + 1))); // blue
+  Expr multiplier = select(R_row, select(R_col, wb.r, wb.g0), // red, green 0
+                           select(R_col, wb.g1, wb.b));       // green 1, blue
+
+  output(x, y) = u16_sat(multiplier * f32(input(x, y)));
 
   ///////////////////////////////////////////////////////////////////////////
   // schedule
@@ -54,11 +51,6 @@ Func white_balance(Func input, Expr width, Expr height,
 
   output.compute_root().parallel(y).vectorize(x, 16);
 
-  output.update(0).parallel(r.y);
-  output.update(1).parallel(r.y);
-  output.update(2).parallel(r.y);
-  output.update(3).parallel(r.y);
-
   return output;
 }
 
@@ -201,6 +193,32 @@ Func demosaic(Func input, Expr width, Expr height) {
   return output;
 }
 
+/*
+ * demosaic_bin -- Produces a color image at half the resolution of an RG/GB
+ * mosaic by binning each 2x2 bayer quad into one pixel. The two green samples
+ * of a quad are averaged. Much cheaper than demosaic, for preview output.
+ */
+Func demosaic_bin(Func input) {
+
+  Func output("demosaic_bin_output");
+
+  Var x, y, c;
+
+  Expr r = input(2 * x, 2 * y);
+  Expr g = u16((u32(input(2 * x + 1, 2 * y)) + input(2 * x, 2 * y + 1)) / 2);
+  Expr b = input(2 * x + 1, 2 * y + 1);
+
+  output(x, y, c) = select(c == 0, r, c == 1, g, b);
+
+  ///////////////////////////////////////////////////////////////////////////
+  // schedule
+  ///////////////////////////////////////////////////////////////////////////
+
+  output.compute_root().parallel(y).vectorize(x, 16);
+
+  return output;
+}
+
 /*
  * bilateral_filter -- Applies a 7x7 bilateral filter to the UV channels of a
  * YUV input to reduce chromatic noise. Chroma values above a threshold are
@@ -723,7 +741,9 @@ Func sharpen(Func input, float strength) {
 
 /*
  * u8bit_interleaved -- Converts to 8 bits and interleaves color channels so
- * output can be easily written to an output file.
+ * output can be easily written to an output file. The three channels of a
+ * vector of pixels are computed together and stored as one dense interleaved
+ * vector, so rows come out in the order an encoder consumes them.
  */
 Func u8bit_interleaved(Func input) {
 
@@ -739,7 +759,12 @@ Func u8bit_interleaved(Func input) {
   // schedule
   ///////////////////////////////////////////////////////////////////////////
 
-  output.compute_root().parallel(y).vectorize(x, 16);
+  output.compute_root()
+      .bound(c, 0, 3)
+      .reorder(c, x, y)
+      .unroll(c)
+      .parallel(y)
+      .vectorize(x, 16);
 
   return output;
 }
@@ -757,22 +782,60 @@ Halide::Func shift_bayer_to_rggb(Halide::Func input,
 }
 
 /*
- * finish -- Applies a series of standard local and global image processing
- * operations to an input mosaicked image, producing a pleasant color output.
- * Input pecifies black-level, white-level and white balance. Additionally,
- * tone mapping is applied to the image, as specified by the input compression
- * and gain amounts. This produces natural-looking brightened shadows, without
- * blowing out highlights. The output values are 8-bit.
+ * finish_tone -- Applies the tone stages of finish to a linear sRGB image and
+ * converts the result to 8 bits. These are the only stages that depend on
+ * compression and gain.
  */
-Halide::Func finish(Halide::Func input, Expr width, Expr height, Expr bp,
-                    Expr wp, const CompiletimeWhiteBalance &wb,
-                    const Expr cfa_pattern, Halide::Func ccm, const Expr c,
-                    const Expr g) {
-  int denoise_passes = 1;
+Halide::Func finish_tone(Halide::Func srgb_output, Expr width, Expr height,
+                         const Expr c, const Expr g) {
   float contrast_strength = 5.f;
   int black_level = 2000;
   float sharpen_strength = 2.f;
 
+  // 6. Tone mapping
+
+  Func tone_map_output = tone_map(srgb_output, width, height, c, g);
+
+  // 7. Gamma correction
+
+  Func gamma_correct_output = gamma_correct(tone_map_output);
+
+  // 8. Global contrast increase
+
+  Func contrast_output =
+      contrast(gamma_correct_output, contrast_strength, black_level);
+
+  // 9. Sharpening
+
+  Func sharpen_output = sharpen(contrast_output, sharpen_strength);
+
+  return u8bit_interleaved(contrast_output);
+}
+
+/*
+ * finish_rgb -- Applies the color and tone stages of finish to a demosaicked,
+ * white-balanced linear image and converts the result to 8 bits.
+ */
+Func finish_rgb(Func input, Expr width, Expr height, Func ccm, Expr c,
+                Expr g) {
+
+  // 5. sRGB color correction
+
+  Func srgb_output = srgb(input, ccm);
+
+  return finish_tone(srgb_output, width, height, c, g);
+}
+
+/*
+ * finish_prefix -- Applies the stages of finish that precede tone mapping,
+ * up to and including color correction, to an input mosaicked image. The
+ * output is a linear sRGB image, identical for any compression and gain.
+ */
+Halide::Func finish_prefix(Halide::Func input, Expr width, Expr height,
+                           Expr bp, Expr wp, const CompiletimeWhiteBalance &wb,
+                           const Expr cfa_pattern, Halide::Func ccm) {
+  int denoise_passes = 1;
+
   Func bayer_shifted = shift_bayer_to_rggb(input, cfa_pattern);
 
   // 1. Black-level subtraction and white-level scaling
@@ -794,26 +857,52 @@ Halide::Func finish(Halide::Func input, Expr width, Expr height, Expr bp,
 
   // 5. sRGB color correction
 
-  Func srgb_output = srgb(demosaic_output, ccm);
+  return srgb(demosaic_output, ccm);
+}
 
-  // 6. Tone mapping
+/*
+ * finish -- Applies a series of standard local and global image processing
+ * operations to an input mosaicked image, producing a pleasant color output.
+ * Input pecifies black-level, white-level and white balance. Additionally,
+ * tone mapping is applied to the image, as specified by the input compression
+ * and gain amounts. This produces natural-looking brightened shadows, without
+ * blowing out highlights. The output values are 8-bit.
+ */
+Halide::Func finish(Halide::Func input, Expr width, Expr height, Expr bp,
+                    Expr wp, const CompiletimeWhiteBalance &wb,
+                    const Expr cfa_pattern, Halide::Func ccm, const Expr c,
+                    const Expr g) {
+  Func srgb_output =
+      finish_prefix(input, width, height, bp, wp, wb, cfa_pattern, ccm);
+  return finish_tone(srgb_output, width, height, c, g);
+}
 
-  Func tone_map_output = tone_map(srgb_output, width, height, c, g);
+/*
+ * finish_preview -- Applies finish to a (downsampled) mosaicked image, but
+ * replaces demosaicking with binning of the bayer quads. The output has half
+ * the width and height of the input.
+ */
+Halide::Func finish_preview(Halide::Func input, Expr width, Expr height,
+                            Expr bp, Expr wp,
+                            const CompiletimeWhiteBalance &wb,
+                            const Expr cfa_pattern, Halide::Func ccm,
+                            const Expr c, const Expr g) {
 
-  // 7. Gamma correction
+  Func bayer_shifted = shift_bayer_to_rggb(input, cfa_pattern);
 
-  Func gamma_correct_output = gamma_correct(tone_map_output);
+  // 1. Black-level subtraction and white-level scaling
+  Func black_white_level_output = black_white_level(bayer_shifted, bp, wp);
 
-  // 8. Global contrast increase
+  // 2. White balancing
 
-  Func contrast_output =
-      contrast(gamma_correct_output, contrast_strength, black_level);
+  Func white_balance_output =
+      white_balance(black_white_level_output, width, height, wb);
 
-  // 9. Sharpening
+  // 3. Binning of bayer quads
 
-  Func sharpen_output = sharpen(contrast_output, sharpen_strength);
+  Func demosaic_output = demosaic_bin(white_balance_output);
 
-  return u8bit_interleaved(contrast_output);
+  return finish_rgb(demosaic_output, width / 2, height / 2, ccm, c, g);
 }
 
 Func finish(Func input, int width, int height, const BlackPoint bp,
@@ -46,4 +46,34 @@ Halide::Func finish(Halide::Func input, int width, int height, BlackPoint bp,
 Halide::Func finish(Halide::Func input, Halide::Expr width, Halide::Expr height,
                     Halide::Expr bp, Halide::Expr wp,
                     const CompiletimeWhiteBalance &wb, Halide::Expr cfa_pattern,
-                    Halide::Func ccm, Halide::Expr c, Halide::Expr g);
\ No newline at end of file
+                    Halide::Func ccm, Halide::Expr c, Halide::Expr g);
+
+/*
+ * finish_prefix -- The stages of finish before tone mapping: black and white
+ * level, white balance, demosaicking and color correction. The output is a
+ * linear sRGB image indexed as (x, y, c), which does not depend on compression
+ * and gain.
+ */
+Halide::Func finish_prefix(Halide::Func input, Halide::Expr width,
+                           Halide::Expr height, Halide::Expr bp,
+                           Halide::Expr wp, const CompiletimeWhiteBalance &wb,
+                           Halide::Expr cfa_pattern, Halide::Func ccm);
+
+/*
+ * finish_tone -- The remaining stages of finish, from tone mapping to the
+ * 8-bit interleaved output, applied to the output of finish_prefix.
+ * finish_tone(finish_prefix(...), ...) is the same as finish(...).
+ */
+Halide::Func finish_tone(Halide::Func input, Halide::Expr width,
+                         Halide::Expr height, Halide::Expr c, Halide::Expr g);
+
+/*
+ * finish_preview -- Applies the same processing as finish, but bins each 2x2
+ * bayer quad into one pixel instead of demosaicking. The output has half the
+ * width and height of the input mosaic and is meant for quick previews.
+ */
+Halide::Func finish_preview(Halide::Func input, Halide::Expr width,
+                            Halide::Expr height, Halide::Expr bp,
+                            Halide::Expr wp, const CompiletimeWhiteBalance &wb,
+                            Halide::Expr cfa_pattern, Halide::Func ccm,
+                            Halide::Expr c, Halide::Expr g);
@@ -0,0 +1,88 @@
+#include "hdrplus_c.h"
+
+#include <exception>
+#include <string>
+
+#include "HdrPlusContext.h"
+#include "InputSource.h"
+
+struct hdrplus_context {
+  HdrPlusContext context;
+  std::string last_error;
+
+  explicit hdrplus_context(int num_threads) : context(num_threads) {}
+};
+
+namespace {
+
+BurstMetadata ToMetadata(const hdrplus_metadata &metadata) {
+  BurstMetadata result;
+  result.black_level = metadata.black_level;
+  result.white_level = metadata.white_level;
+  result.white_balance =
+      WhiteBalance(metadata.white_balance[0], metadata.white_balance[1],
+                   metadata.white_balance[2], metadata.white_balance[3]);
+  result.cfa_pattern = static_cast<CfaPattern>(metadata.cfa_pattern);
+  for (int i = 0; i < 9; i++) {
+    result.color_correction[i] = metadata.color_correction[i];
+  }
+  return result;
+}
+
+} // namespace
+
+extern "C" {
+
+hdrplus_context *hdrplus_context_create(int num_threads) {
+  try {
+    return new hdrplus_context(num_threads);
+  } catch (const std::exception &) {
+    return nullptr;
+  }
+}
+
+void hdrplus_context_destroy(hdrplus_context *context) { delete context; }
+
+int hdrplus_process(hdrplus_context *context, const uint16_t *frames,
+                    int width, int height, int num_frames,
+                    ptrdiff_t row_stride, ptrdiff_t frame_stride,
+                    const hdrplus_metadata *metadata, float compression,
+                    float gain, uint8_t *output) {
+  try {
+    const BayerInput input(frames, width, height, num_frames, row_stride,
+                           frame_stride, ToMetadata(*metadata));
+    ProcessOptions options;
+    options.compression = compression;
+    options.gain = gain;
+    Halide::Runtime::Buffer<uint8_t> output_img(output, 3, width, height);
+    context->context.Process(input.GetFrames(), input.GetMetadata(), options,
+                             output_img);
+  } catch (const std::exception &e) {
+    context->last_error = e.what();
+    return -1;
+  }
+  return 0;
+}
+
+int hdrplus_align_and_merge(hdrplus_context *context, const uint16_t *frames,
+                            int width, int height, int num_frames,
+                            ptrdiff_t row_stride, ptrdiff_t frame_stride,
+                            uint16_t *output) {
+  try {
+    // Align and merge does not read any metadata.
+    const BayerInput input(frames, width, height, num_frames, row_stride,
+                           frame_stride, BurstMetadata());
+    Halide::Runtime::Buffer<uint16_t> output_img(output, width, height);
+    context->context.AlignAndMerge(input.GetFrames(), output_img);
+  } catch (const std::exception &e) {
+    context->last_error = e.what();
+    return -1;
+  }
+  return 0;
+}
+
+const char *hdrplus_last_error(const hdrplus_context *context) {
+  return context->last_error.c_str();
+}
+
+} // extern "C"
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C interface of HdrPlusContext. Frames are passed as width x height 16-bit
+ * bayer samples each, num_frames of them, with frame 0 as the reference.
+ * Strides are given in samples and the frames are read in place. Functions
+ * returning int return 0 on success; hdrplus_last_error then describes a
+ * failure.
+ */
+
+typedef struct hdrplus_context hdrplus_context;
+
+typedef struct hdrplus_metadata {
+  int black_level;
+  int white_level;
+  float white_balance[4];     // r, g0, g1, b
+  int cfa_pattern;            // 1 RGGB, 2 GRBG, 3 BGGR, 4 GBRG
+  float color_correction[9];  // camera RGB to sRGB, row-major
+} hdrplus_metadata;
+
+// A num_threads of 0 uses one thread per core. Returns NULL on failure.
+hdrplus_context *hdrplus_context_create(int num_threads);
+
+void hdrplus_context_destroy(hdrplus_context *context);
+
+// Renders the burst into 'output', width * height * 3 bytes of interleaved
+// 8-bit RGB.
+int hdrplus_process(hdrplus_context *context, const uint16_t *frames,
+                    int width, int height, int num_frames,
+                    ptrdiff_t row_stride, ptrdiff_t frame_stride,
+                    const hdrplus_metadata *metadata, float compression,
+                    float gain, uint8_t *output);
+
+// Aligns and merges the burst into 'output', width * height 16-bit bayer
+// samples.
+int hdrplus_align_and_merge(hdrplus_context *context, const uint16_t *frames,
+                            int width, int height, int num_frames,
+                            ptrdiff_t row_stride, ptrdiff_t frame_stride,
+                            uint16_t *output);
+
+const char *hdrplus_last_error(const hdrplus_context *context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,6 +8,85 @@ namespace {
 
 class HdrPlusPipeline : public Halide::Generator<HdrPlusPipeline> {
 public:
+  // Merges with zero alignment offsets instead of searching for them, for
+  // bursts of a static scene.
+  GeneratorParam<bool> static_scene{"static_scene", false};
+  // Alignment tiles and search, see AlignParams
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+  GeneratorParam<bool> coarse_u8{"coarse_u8", false};
+
+  // 'inputs' is really a series of raw 2d frames; extent[2] specifies the count
+  Input<Halide::Buffer<uint16_t>> inputs{"inputs", 3};
+  // frame_map(i) is the frame of 'inputs' merged as frame i, with frame 0 as
+  // the reference, so a burst can be merged with another reference or without
+  // some of its frames in place.
+  Input<Halide::Buffer<int32_t>> frame_map{"frame_map", 1};
+  Input<uint16_t> black_point{"black_point"};
+  Input<uint16_t> white_point{"white_point"};
+  Input<float> white_balance_r{"white_balance_r"};
+  Input<float> white_balance_g0{"white_balance_g0"};
+  Input<float> white_balance_g1{"white_balance_g1"};
+  Input<float> white_balance_b{"white_balance_b"};
+  Input<int> cfa_pattern{"cfa_pattern"};
+  Input<Halide::Buffer<float>> ccm{"ccm", 2}; // ccm - color correction matrix
+
+  Input<float> compression{"compression"};
+  Input<float> gain{"gain"};
+
+  // RGB output, interleaved as output(c, x, y) in row-major order. The output
+  // buffer may cover any crop of the frame (with x and y mins set
+  // accordingly); only the tiles needed for the crop are processed.
+  Output<Halide::Buffer<uint8_t>> output{"output", 3};
+
+  void generate() {
+    Var x, y, n;
+
+    Expr width = inputs.width();
+    Expr height = inputs.height();
+
+    const AlignParams params{tile_size.value(), search_radius.value(),
+                             coarse_u8.value()};
+    params.Validate();
+
+    // Algorithm
+    Expr frame = clamp(frame_map(n), 0, inputs.dim(2).extent() - 1);
+    Func imgs("burst_frames");
+    imgs(x, y, n) = inputs(x, y, frame);
+
+    Func alignment = static_scene.value()
+                         ? align_static()
+                         : align(imgs, width, height, params, white_point);
+    Func merged = merge(imgs, width, height, frame_map.dim(0).extent(),
+                        alignment, params);
+    CompiletimeWhiteBalance wb{white_balance_r, white_balance_g0,
+                               white_balance_g1, white_balance_b};
+    Func finished = finish(merged, width, height, black_point, white_point, wb,
+                           cfa_pattern, ccm, compression, gain);
+    output = finished;
+    // Schedule handled inside included functions
+
+    output.dim(0).set_bounds(0, 3).set_stride(1);
+    output.dim(1).set_stride(3);
+  }
+};
+
+/*
+ * HdrPlusPreview -- Low resolution variant of HdrPlusPipeline for quick
+ * previews. Alignment stops at the coarse layers of the pyramid, frames are
+ * merged directly into a downsampled mosaic and the bayer quads are binned
+ * instead of demosaicked. The output has the same layout as the output of
+ * HdrPlusPipeline, with width and height divided by 'downsample'.
+ */
+class HdrPlusPreview : public Halide::Generator<HdrPlusPreview> {
+public:
+  // Alignment tiles and search, see AlignParams
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+  GeneratorParam<bool> coarse_u8{"coarse_u8", false};
+
   // 'inputs' is really a series of raw 2d frames; extent[2] specifies the count
   Input<Halide::Buffer<uint16_t>> inputs{"inputs", 3};
   Input<uint16_t> black_point{"black_point"};
@@ -22,24 +101,384 @@ public:
   Input<float> compression{"compression"};
   Input<float> gain{"gain"};
 
-  // RGB output
+  // Reduction of output width and height; an even number such as 4 or 8
+  Input<int> downsample{"downsample"};
+
+  // RGB output, interleaved as output(c, x, y) in row-major order
+  Output<Halide::Buffer<uint8_t>> output{"output", 3};
+
+  void generate() {
+    // The merged mosaic is downsampled by half of the total factor; binning
+    // its bayer quads in finish provides the other half.
+    Expr factor = Expr(downsample) / 2;
+    Expr width = inputs.width() / factor / 2 * 2;
+    Expr height = inputs.height() / factor / 2 * 2;
+
+    // Algorithm
+    const AlignParams params{tile_size.value(), search_radius.value(),
+                             coarse_u8.value()};
+    params.Validate();
+    Func alignment =
+        align_coarse(inputs, inputs.width(), inputs.height(), params,
+                     white_point);
+    Func merged = merge_preview(inputs, inputs.width(), inputs.height(),
+                                inputs.dim(2).extent(), alignment, factor,
+                                params);
+    CompiletimeWhiteBalance wb{white_balance_r, white_balance_g0,
+                               white_balance_g1, white_balance_b};
+    Func finished =
+        finish_preview(merged, width, height, black_point, white_point, wb,
+                       cfa_pattern, ccm, compression, gain);
+    output = finished;
+    // Schedule handled inside included functions
+
+    output.dim(0).set_bounds(0, 3).set_stride(1);
+    output.dim(1).set_stride(3);
+  }
+};
+
+/*
+ * FramePyramid -- The alignment pyramid of one frame, as built by align for
+ * every frame of a burst. Computing it as a frame arrives leaves only the
+ * search and the merge to HdrPlusFromPyramid.
+ */
+class FramePyramid : public Halide::Generator<FramePyramid> {
+public:
+  Input<Halide::Buffer<uint16_t>> frame{"frame", 2};
+
+  // Finest layer first
+  Output<Halide::Buffer<uint16_t>> layer_0{"layer_0", 2};
+  Output<Halide::Buffer<uint16_t>> layer_1{"layer_1", 2};
+  Output<Halide::Buffer<uint16_t>> layer_2{"layer_2", 2};
+
+  void generate() {
+    Var x, y, n;
+
+    // Algorithm
+    Func frames("pyramid_frames");
+    frames(x, y, n) = frame(x, y);
+    std::vector<Func> layers =
+        align_pyramid(frames, frame.width(), frame.height());
+    layer_0(x, y) = layers[0](x, y, 0);
+    layer_1(x, y) = layers[1](x, y, 0);
+    layer_2(x, y) = layers[2](x, y, 0);
+
+    // Schedule
+    layer_0.parallel(y).vectorize(x, 16);
+  }
+};
+
+/*
+ * FrameSharpness -- Gradient energy of every frame of layer(x, y, n), layer 1
+ * of the alignment pyramids computed by FramePyramid, for picking the
+ * sharpest frame of a burst as its reference. The coarse layer makes it
+ * cheap. With from_frames, the input holds raw frames instead and only their
+ * layer 1 is kept (align_pyramid_layer), so candidates can be measured without
+ * building their pyramids.
+ */
+class FrameSharpness : public Halide::Generator<FrameSharpness> {
+public:
+  GeneratorParam<bool> from_frames{"from_frames", false};
+
+  Input<Halide::Buffer<uint16_t>> layer{"layer", 3};
+
+  Output<Halide::Buffer<float>> sharpness{"sharpness", 1};
+
+  void generate() {
+    Var n;
+
+    // Algorithm
+    Func layer_1 = layer;
+    Expr width = layer.width();
+    Expr height = layer.height();
+    if (from_frames.value()) {
+      layer_1 = align_pyramid_layer(layer, width, height, 1);
+      width = width / 2 / DOWNSAMPLE_RATE;
+      height = height / 2 / DOWNSAMPLE_RATE;
+    }
+    Func energy = gradient_energy(layer_1, width, height);
+    sharpness(n) = energy(n);
+
+    // Schedule
+    sharpness.parallel(n);
+  }
+};
+
+/*
+ * CoarseResidual -- Residual of every frame of a burst after aligning layer 2
+ * of its pyramid to that of the reference, as computed by coarse_residual,
+ * and without aligning it, for detecting static scenes.
+ * The frames and their reference are selected by frame_map as for
+ * HdrPlusFromPyramid, so frames that would not merge can be left out of the
+ * frame_map passed to it. With from_frames, the input holds raw frames
+ * instead and only layer 2 of the frames in frame_map is kept
+ * (align_pyramid_layer), so a burst can be checked without building its
+ * pyramids.
+ */
+class CoarseResidual : public Halide::Generator<CoarseResidual> {
+public:
+  // Alignment tiles and search, see AlignParams
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+  GeneratorParam<bool> from_frames{"from_frames", false};
+
+  // Layer 2 of the pyramids computed by FramePyramid, indexed by slot
+  Input<Halide::Buffer<uint16_t>> layer_2{"layer_2", 3};
+  Input<Halide::Buffer<int32_t>> frame_map{"frame_map", 1};
+
+  // Residual after the search, and with all tiles at offset (0, 0)
+  Output<Halide::Buffer<float>> residual{"residual", 1};
+  Output<Halide::Buffer<float>> residual_static{"residual_static", 1};
+
+  void generate() {
+    Var x, y, n;
+
+    Expr width = layer_2.dim(0).extent();
+    Expr height = layer_2.dim(1).extent();
+
+    // Algorithm
+    Expr slot = clamp(frame_map(n), 0, layer_2.dim(2).extent() - 1);
+
+    Func alt_layer("coarse_burst");
+    if (from_frames.value()) {
+      Func imgs("coarse_frames");
+      imgs(x, y, n) = layer_2(x, y, slot);
+      alt_layer = align_pyramid_layer(imgs, width, height, 2);
+      width = width / 2 / (DOWNSAMPLE_RATE * DOWNSAMPLE_RATE);
+      height = height / 2 / (DOWNSAMPLE_RATE * DOWNSAMPLE_RATE);
+    } else {
+      Func mirrored = Halide::BoundaryConditions::mirror_interior(
+          layer_2, {Halide::Range(0, width), Halide::Range(0, height)});
+      alt_layer(x, y, n) = mirrored(x, y, slot);
+    }
+    Func ref_layer("coarse_ref");
+    ref_layer(x, y) = alt_layer(x, y, 0);
+
+    const AlignParams params{tile_size.value(), search_radius.value()};
+    params.Validate();
+    Func frame_residual =
+        coarse_residual(ref_layer, alt_layer, width, height, params);
+    residual(n) = frame_residual(n);
+    Func frame_residual_static =
+        static_residual(ref_layer, alt_layer, width, height, params);
+    residual_static(n) = frame_residual_static(n);
+
+    // Schedule
+    residual.parallel(n);
+    residual_static.parallel(n);
+  }
+};
+
+/*
+ * HdrPlusFromPyramid -- HdrPlusPipeline for frames whose alignment pyramids
+ * were computed beforehand by FramePyramid, such as the slots of a ring
+ * buffer. frame_map(i) is the slot holding frame i of the burst, with frame 0
+ * as the reference; only the alignment search, the merge and finish run.
+ */
+class HdrPlusFromPyramid : public Halide::Generator<HdrPlusFromPyramid> {
+public:
+  // As for HdrPlusPipeline
+  GeneratorParam<bool> static_scene{"static_scene", false};
+  // Alignment tiles and search, see AlignParams
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+  GeneratorParam<bool> coarse_u8{"coarse_u8", false};
+
+  // Frames and their pyramid layers, indexed by slot in the last dimension
+  Input<Halide::Buffer<uint16_t>> frames{"frames", 3};
+  Input<Halide::Buffer<uint16_t>> layer_0{"layer_0", 3};
+  Input<Halide::Buffer<uint16_t>> layer_1{"layer_1", 3};
+  Input<Halide::Buffer<uint16_t>> layer_2{"layer_2", 3};
+  Input<Halide::Buffer<int32_t>> frame_map{"frame_map", 1};
+
+  Input<uint16_t> black_point{"black_point"};
+  Input<uint16_t> white_point{"white_point"};
+  Input<float> white_balance_r{"white_balance_r"};
+  Input<float> white_balance_g0{"white_balance_g0"};
+  Input<float> white_balance_g1{"white_balance_g1"};
+  Input<float> white_balance_b{"white_balance_b"};
+  Input<int> cfa_pattern{"cfa_pattern"};
+  Input<Halide::Buffer<float>> ccm{"ccm", 2}; // ccm - color correction matrix
+
+  Input<float> compression{"compression"};
+  Input<float> gain{"gain"};
+
+  // RGB output, interleaved as output(c, x, y) in row-major order. As for
+  // HdrPlusPipeline, the output buffer may cover any crop of the frame.
   Output<Halide::Buffer<uint8_t>> output{"output", 3};
 
   void generate() {
+    Var x, y, n;
+
+    Expr width = frames.width();
+    Expr height = frames.height();
+    Expr num_frames = frame_map.dim(0).extent();
+
     // Algorithm
-    Func alignment = align(inputs, inputs.width(), inputs.height());
-    Func merged = merge(inputs, inputs.width(), inputs.height(),
-                        inputs.dim(2).extent(), alignment);
+    Expr slot = clamp(frame_map(n), 0, frames.dim(2).extent() - 1);
+
+    Func imgs("burst_frames");
+    imgs(x, y, n) = frames(x, y, slot);
+
+    // The stored layers end at the frame; mirroring them stands in for the
+    // mirrored frame they were computed from.
+    std::vector<Func> ref_layers, alt_layers;
+    for (const auto *layer : {&layer_0, &layer_1, &layer_2}) {
+      Func mirrored = Halide::BoundaryConditions::mirror_interior(
+          *layer, {Halide::Range(0, (*layer).dim(0).extent()),
+                   Halide::Range(0, (*layer).dim(1).extent())});
+      Func alt_layer((*layer).name() + "_burst");
+      alt_layer(x, y, n) = mirrored(x, y, slot);
+      Func ref_layer((*layer).name() + "_ref");
+      ref_layer(x, y) = alt_layer(x, y, 0);
+      alt_layers.push_back(alt_layer);
+      ref_layers.push_back(ref_layer);
+    }
+
+    const AlignParams params{tile_size.value(), search_radius.value(),
+                             coarse_u8.value()};
+    params.Validate();
+    Func alignment = static_scene.value()
+                         ? align_static()
+                         : align_from_layers(ref_layers, alt_layers, width,
+                                             height, false, params,
+                                             white_point);
+    Func merged = merge(imgs, alt_layers[0], width, height, num_frames,
+                        alignment, params);
     CompiletimeWhiteBalance wb{white_balance_r, white_balance_g0,
                                white_balance_g1, white_balance_b};
     Func finished =
-        finish(merged, inputs.width(), inputs.height(), black_point,
+        finish(merged, width, height, black_point, white_point, wb,
+               cfa_pattern, ccm, compression, gain);
+    output = finished;
+    // Schedule handled inside included functions
+
+    output.dim(0).set_bounds(0, 3).set_stride(1);
+    output.dim(1).set_stride(3);
+  }
+};
+
+/*
+ * FinishPipeline -- The finishing stages of HdrPlusPipeline alone, applied to
+ * a bayer frame that was already aligned and merged (for example the output of
+ * align_and_merge). Since the merged frame does not depend on compression and
+ * gain, a burst can be re-rendered with new tone mapping parameters without
+ * aligning and merging it again. The output has the same layout as the output
+ * of HdrPlusPipeline.
+ */
+class FinishPipeline : public Halide::Generator<FinishPipeline> {
+public:
+  Input<Halide::Buffer<uint16_t>> merged{"merged", 2};
+  Input<uint16_t> black_point{"black_point"};
+  Input<uint16_t> white_point{"white_point"};
+  Input<float> white_balance_r{"white_balance_r"};
+  Input<float> white_balance_g0{"white_balance_g0"};
+  Input<float> white_balance_g1{"white_balance_g1"};
+  Input<float> white_balance_b{"white_balance_b"};
+  Input<int> cfa_pattern{"cfa_pattern"};
+  Input<Halide::Buffer<float>> ccm{"ccm", 2}; // ccm - color correction matrix
+
+  Input<float> compression{"compression"};
+  Input<float> gain{"gain"};
+
+  // RGB output, interleaved as output(c, x, y) in row-major order. As for
+  // HdrPlusPipeline, the output buffer may cover any crop of the frame.
+  Output<Halide::Buffer<uint8_t>> output{"output", 3};
+
+  void generate() {
+    // Algorithm
+    // The bayer shift and the stencils of finish read past the frame; the
+    // mirror keeps the mosaic pattern intact there.
+    Func merged_mirror = Halide::BoundaryConditions::mirror_interior(merged);
+    CompiletimeWhiteBalance wb{white_balance_r, white_balance_g0,
+                               white_balance_g1, white_balance_b};
+    Func finished =
+        finish(merged_mirror, merged.width(), merged.height(), black_point,
                white_point, wb, cfa_pattern, ccm, compression, gain);
     output = finished;
     // Schedule handled inside included functions
+
+    output.dim(0).set_bounds(0, 3).set_stride(1);
+    output.dim(1).set_stride(3);
+  }
+};
+
+/*
+ * FinishPrefix -- The stages of FinishPipeline that do not depend on
+ * compression and gain, up to the linear sRGB image. Together with FinishTone
+ * it lets a parameter sweep compute them once for all parameter pairs.
+ */
+class FinishPrefix : public Halide::Generator<FinishPrefix> {
+public:
+  Input<Halide::Buffer<uint16_t>> merged{"merged", 2};
+  Input<uint16_t> black_point{"black_point"};
+  Input<uint16_t> white_point{"white_point"};
+  Input<float> white_balance_r{"white_balance_r"};
+  Input<float> white_balance_g0{"white_balance_g0"};
+  Input<float> white_balance_g1{"white_balance_g1"};
+  Input<float> white_balance_b{"white_balance_b"};
+  Input<int> cfa_pattern{"cfa_pattern"};
+  Input<Halide::Buffer<float>> ccm{"ccm", 2}; // ccm - color correction matrix
+
+  // Linear sRGB image, indexed as output(x, y, c)
+  Output<Halide::Buffer<uint16_t>> output{"output", 3};
+
+  void generate() {
+    Var x, y, c;
+
+    // Algorithm
+    Func merged_mirror = Halide::BoundaryConditions::mirror_interior(merged);
+    CompiletimeWhiteBalance wb{white_balance_r, white_balance_g0,
+                               white_balance_g1, white_balance_b};
+    Func srgb_output =
+        finish_prefix(merged_mirror, merged.width(), merged.height(),
+                      black_point, white_point, wb, cfa_pattern, ccm);
+    output(x, y, c) = srgb_output(x, y, c);
+
+    // Schedule
+    output.bound(c, 0, 3).reorder(c, x, y).unroll(c).parallel(y).vectorize(
+        x, 16);
+  }
+};
+
+/*
+ * FinishTone -- The stages of FinishPipeline from tone mapping on, applied to
+ * the output of FinishPrefix. The output has the same layout as the output of
+ * HdrPlusPipeline.
+ */
+class FinishTone : public Halide::Generator<FinishTone> {
+public:
+  // Linear sRGB image, indexed as srgb(x, y, c)
+  Input<Halide::Buffer<uint16_t>> srgb{"srgb", 3};
+
+  Input<float> compression{"compression"};
+  Input<float> gain{"gain"};
+
+  // RGB output, interleaved as output(c, x, y) in row-major order
+  Output<Halide::Buffer<uint8_t>> output{"output", 3};
+
+  void generate() {
+    // Algorithm
+    Func finished =
+        finish_tone(srgb, srgb.width(), srgb.height(), compression, gain);
+    output = finished;
+    // Schedule handled inside included functions
+
+    output.dim(0).set_bounds(0, 3).set_stride(1);
+    output.dim(1).set_stride(3);
   }
 };
 
 } // namespace
 
 HALIDE_REGISTER_GENERATOR(HdrPlusPipeline, hdrplus_pipeline)
+HALIDE_REGISTER_GENERATOR(HdrPlusPreview, hdrplus_preview)
+HALIDE_REGISTER_GENERATOR(FramePyramid, frame_pyramid)
+HALIDE_REGISTER_GENERATOR(FrameSharpness, frame_sharpness)
+HALIDE_REGISTER_GENERATOR(CoarseResidual, coarse_residual_pipeline)
+HALIDE_REGISTER_GENERATOR(HdrPlusFromPyramid, hdrplus_from_pyramid)
+HALIDE_REGISTER_GENERATOR(FinishPipeline, finish_pipeline)
+HALIDE_REGISTER_GENERATOR(FinishPrefix, finish_prefix_pipeline)
+HALIDE_REGISTER_GENERATOR(FinishTone, finish_tone_pipeline)
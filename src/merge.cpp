@@ -9,48 +9,37 @@ using namespace Halide;
 using namespace Halide::ConciseCasts;
 
 /*
- * merge_temporal -- combines aligned tiles in the temporal dimension by
- * weighting various frames based on their L1 distance to the reference frame's
- * tile. Thresholds L1 scores so that tiles above a certain distance are
+ * merge_temporal_weights -- weights the tiles of each alternate frame based on
+ * their L1 distance to the reference frame's tile, measured on a downsampled
+ * layer. Thresholds L1 scores so that tiles above a certain distance are
  * completely discounted, and tiles below a certain distance are assumed to be
- * perfectly aligned.
+ * perfectly aligned. ref_layer is the layer of the reference frame, alt_layer
+ * the same layer of the alternate frames.
  */
-Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
-                    Func alignment) {
+Func merge_temporal_weights(Func ref_layer, Func alt_layer, Func alignment,
+                            const AlignParams &params) {
 
   Func weight("merge_temporal_weights");
-  Func total_weight("merge_temporal_total_weights");
-  Func output("merge_temporal_output");
-
-  Var ix, iy, tx, ty, n;
-  RDom r0(0, 16, 0, 16);  // reduction over pixels in downsampled tile
-  RDom r1(1, frames - 1); // reduction over alternate images
-
-  // mirror input with overlapping edges
 
-  Func imgs_mirror = BoundaryConditions::mirror_interior(
-      imgs, {Range(0, width), Range(0, height)});
+  Var tx, ty, n;
+  const int t_size_2 = params.tile_size_2();
+  RDom r0(0, t_size_2, 0, t_size_2); // reduction over pixels in tile
 
-  // downsampled layer for computing L1 distances
+  // alignment offset, indicies and pixel value expressions
 
-  Func layer = box_down2(imgs_mirror, "merge_layer");
+  const int min_offset = params.min_offset();
+  const int max_offset = params.max_offset();
+  Point offset = clamp(P(alignment(tx, ty, n)), P(min_offset, min_offset),
+                       P(max_offset, max_offset));
 
-  // alignment offset, indicies and pixel value expressions; used twice in
-  // different reductions
+  Expr x0 = idx_layer(tx, r0.x, params);
+  Expr y0 = idx_layer(ty, r0.y, params);
 
-  Point offset;
-  Expr al_x, al_y, ref_val, alt_val;
+  Expr al_x = x0 + offset.x / 2;
+  Expr al_y = y0 + offset.y / 2;
 
-  // expressions for summing over pixels in each tile
-
-  offset = clamp(P(alignment(tx, ty, n)), P(MIN_OFFSET, MIN_OFFSET),
-                 P(MAX_OFFSET, MAX_OFFSET));
-
-  al_x = idx_layer(tx, r0.x) + offset.x / 2;
-  al_y = idx_layer(ty, r0.y) + offset.y / 2;
-
-  ref_val = layer(idx_layer(tx, r0.x), idx_layer(ty, r0.y), 0);
-  alt_val = layer(al_x, al_y, n);
+  Expr ref_val = ref_layer(x0, y0);
+  Expr alt_val = alt_layer(al_x, al_y, n);
 
   // constants for determining strength and robustness of temporal merge
 
@@ -60,7 +49,7 @@ Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
 
   // average L1 distance in tile and distance normalized to min and factor
 
-  Expr dist = sum(abs(i32(ref_val) - i32(alt_val))) / 256;
+  Expr dist = sum(abs(i32(ref_val) - i32(alt_val))) / (t_size_2 * t_size_2);
 
   Expr norm_dist = max(1, i32(dist) / factor - min_dist / factor);
 
@@ -70,6 +59,46 @@ Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
   weight(tx, ty, n) =
       select(norm_dist > (max_dist - min_dist), 0.f, 1.f / norm_dist);
 
+  ///////////////////////////////////////////////////////////////////////////
+  // schedule
+  ///////////////////////////////////////////////////////////////////////////
+
+  weight.compute_root().parallel(ty).vectorize(tx, 16);
+
+  return weight;
+}
+
+Func merge_temporal_weights(Func layer, Func alignment,
+                            const AlignParams &params) {
+  Func ref_layer(layer.name() + "_ref");
+  Var x, y;
+  ref_layer(x, y) = layer(x, y, 0);
+  return merge_temporal_weights(ref_layer, layer, alignment, params);
+}
+
+/*
+ * merge_temporal -- combines aligned tiles in the temporal dimension by
+ * weighting various frames based on their L1 distance to the reference frame's
+ * tile, measured on layer, the frames downsampled by box_down2.
+ */
+Func merge_temporal(Halide::Func imgs, Func layer, Expr width, Expr height,
+                    Expr frames, Func alignment, const AlignParams &params) {
+
+  Func total_weight("merge_temporal_total_weights");
+  Func output("merge_temporal_output");
+
+  Var ix, iy, tx, ty, n;
+  RDom r1(1, frames - 1); // reduction over alternate images
+
+  // mirror input with overlapping edges
+
+  Func imgs_mirror = BoundaryConditions::mirror_interior(
+      imgs, {Range(0, width), Range(0, height)});
+
+  // weight for each tile in temporal merge
+
+  Func weight = merge_temporal_weights(layer, alignment, params);
+
   // total weight for each tile in a temporal stack of images
 
   total_weight(tx, ty) = sum(weight(tx, ty, r1)) +
@@ -77,13 +106,14 @@ Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
 
   // expressions for summing over images at each pixel
 
-  offset = P(alignment(tx, ty, r1));
+  Point offset = P(alignment(tx, ty, r1));
 
-  al_x = idx_im(tx, ix) + offset.x;
-  al_y = idx_im(ty, iy) + offset.y;
+  Expr al_x = idx_im(tx, ix, params) + offset.x;
+  Expr al_y = idx_im(ty, iy, params) + offset.y;
 
-  ref_val = imgs_mirror(idx_im(tx, ix), idx_im(ty, iy), 0);
-  alt_val = imgs_mirror(al_x, al_y, r1);
+  Expr ref_val =
+      imgs_mirror(idx_im(tx, ix, params), idx_im(ty, iy, params), 0);
+  Expr alt_val = imgs_mirror(al_x, al_y, r1);
 
   // temporal merge function using weighted pixel values
 
@@ -95,8 +125,6 @@ Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
   // schedule
   ///////////////////////////////////////////////////////////////////////////
 
-  weight.compute_root().parallel(ty).vectorize(tx, 16);
-
   total_weight.compute_root().parallel(ty).vectorize(tx, 16);
 
   output.compute_root().parallel(ty).vectorize(ix, 32);
@@ -104,11 +132,23 @@ Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
   return output;
 }
 
+Func merge_temporal(Halide::Func imgs, Expr width, Expr height, Expr frames,
+                    Func alignment, const AlignParams &params) {
+
+  // downsampled layer for computing L1 distances
+
+  Func imgs_mirror = BoundaryConditions::mirror_interior(
+      imgs, {Range(0, width), Range(0, height)});
+  Func layer = box_down2(imgs_mirror, "merge_layer");
+
+  return merge_temporal(imgs, layer, width, height, frames, alignment, params);
+}
+
 /*
  * merge_spatial -- smoothly blends between half-overlapped tiles in the spatial
  * domain using a raised cosine filter.
  */
-Func merge_spatial(Func input) {
+Func merge_spatial(Func input, const AlignParams &params) {
 
   Func weight("raised_cosine_weights");
   Func output("merge_spatial_output");
@@ -118,21 +158,28 @@ Func merge_spatial(Func input) {
   // (modified) raised cosine window for determining pixel weights
 
   float pi = 3.141592f;
-  weight(v) = 0.5f - 0.5f * cos(2 * pi * (v + 0.5f) / T_SIZE);
+  weight(v) = 0.5f - 0.5f * cos(2 * pi * (v + 0.5f) / params.tile_size);
+
+  // indices into the tiles and tiles that a pixel touches
+
+  Expr idx_0x = idx_0(x, params), idx_0y = idx_0(y, params);
+  Expr idx_1x = idx_1(x, params), idx_1y = idx_1(y, params);
+  Expr tile_0x = tile_0(x, params), tile_0y = tile_0(y, params);
+  Expr tile_1x = tile_1(x, params), tile_1y = tile_1(y, params);
 
   // tile weights based on pixel position
 
-  Expr weight_00 = weight(idx_0(x)) * weight(idx_0(y));
-  Expr weight_10 = weight(idx_1(x)) * weight(idx_0(y));
-  Expr weight_01 = weight(idx_0(x)) * weight(idx_1(y));
-  Expr weight_11 = weight(idx_1(x)) * weight(idx_1(y));
+  Expr weight_00 = weight(idx_0x) * weight(idx_0y);
+  Expr weight_10 = weight(idx_1x) * weight(idx_0y);
+  Expr weight_01 = weight(idx_0x) * weight(idx_1y);
+  Expr weight_11 = weight(idx_1x) * weight(idx_1y);
 
   // values of pixels from each overlapping tile
 
-  Expr val_00 = input(idx_0(x), idx_0(y), tile_0(x), tile_0(y));
-  Expr val_10 = input(idx_1(x), idx_0(y), tile_1(x), tile_0(y));
-  Expr val_01 = input(idx_0(x), idx_1(y), tile_0(x), tile_1(y));
-  Expr val_11 = input(idx_1(x), idx_1(y), tile_1(x), tile_1(y));
+  Expr val_00 = input(idx_0x, idx_0y, tile_0x, tile_0y);
+  Expr val_10 = input(idx_1x, idx_0y, tile_1x, tile_0y);
+  Expr val_01 = input(idx_0x, idx_1y, tile_0x, tile_1y);
+  Expr val_11 = input(idx_1x, idx_1y, tile_1x, tile_1y);
 
   // spatial merge function using weighted pixel values
 
@@ -155,13 +202,170 @@ Func merge_spatial(Func input) {
  * dimension to produce one denoised bayer frame.
  */
 Func merge(Halide::Func imgs, Halide::Expr width, Halide::Expr height,
-           Halide::Expr frames, Halide::Func alignment) {
+           Halide::Expr frames, Halide::Func alignment,
+           const AlignParams &params) {
   Func merge_temporal_output =
-      merge_temporal(imgs, width, height, frames, alignment);
-  return merge_spatial(merge_temporal_output);
+      merge_temporal(imgs, width, height, frames, alignment, params);
+  return merge_spatial(merge_temporal_output, params);
+}
+
+Func merge(Halide::Func imgs, Halide::Func layer, Halide::Expr width,
+           Halide::Expr height, Halide::Expr frames, Halide::Func alignment,
+           const AlignParams &params) {
+  Func merge_temporal_output =
+      merge_temporal(imgs, layer, width, height, frames, alignment, params);
+  return merge_spatial(merge_temporal_output, params);
 }
 
 Halide::Func merge(Halide::Buffer<uint16_t> imgs, Halide::Func alignment) {
   return merge(Halide::Func(imgs), imgs.width(), imgs.height(), imgs.extent(2),
                alignment);
 }
+
+/*
+ * merge_preview -- merges aligned frames directly into a mosaic downsampled by
+ * factor in each dimension. Each output pixel averages the factor x factor
+ * same-color pixels it covers in every frame, shifted by the alignment of the
+ * tile nearest to them and weighted by the same temporal tile weights as the
+ * full resolution merge. The bayer pattern of the input is preserved.
+ */
+Func merge_preview(Halide::Func imgs, Halide::Expr width, Halide::Expr height,
+                   Halide::Expr frames, Halide::Func alignment,
+                   Halide::Expr factor, const AlignParams &params) {
+
+  Func total_weight("merge_preview_total_weights");
+  Func output("merge_preview_output");
+
+  Var x, y, tx, ty;
+  RDom r0(0, factor, 0, factor);                // reduction over binned quads
+  RDom r1(0, factor, 0, factor, 1, frames - 1); // and over alternate images
+
+  // mirror input with overlapping edges
+
+  Func imgs_mirror = BoundaryConditions::mirror_interior(
+      imgs, {Range(0, width), Range(0, height)});
+
+  // temporal weights of each tile, computed as in the full resolution merge
+
+  Func layer = box_down2(imgs_mirror, "merge_preview_layer");
+
+  Func weight = merge_temporal_weights(layer, alignment, params);
+
+  total_weight(tx, ty) = sum(weight(tx, ty, r1.z)) + 1.f;
+
+  // top-left input pixel of the same color as the output pixel, and the tile
+  // whose center is closest to the block of binned quads
+
+  Expr im_x = 2 * (x / 2) * factor + x % 2;
+  Expr im_y = 2 * (y / 2) * factor + y % 2;
+
+  const int t_size_2 = params.tile_size_2();
+  Expr near_tx = (2 * (x / 2) * factor + factor - t_size_2 / 2) / t_size_2;
+  Expr near_ty = (2 * (y / 2) * factor + factor - t_size_2 / 2) / t_size_2;
+
+  Point offset = P(alignment(near_tx, near_ty, r1.z));
+
+  Expr ref_val = sum(f32(imgs_mirror(im_x + 2 * r0.x, im_y + 2 * r0.y, 0)));
+  Expr alt_val = sum(weight(near_tx, near_ty, r1.z) *
+                     f32(imgs_mirror(im_x + 2 * r1.x + offset.x,
+                                     im_y + 2 * r1.y + offset.y, r1.z)));
+
+  output(x, y) = u16((ref_val + alt_val) /
+                     (factor * factor * total_weight(near_tx, near_ty)));
+
+  ///////////////////////////////////////////////////////////////////////////
+  // schedule
+  ///////////////////////////////////////////////////////////////////////////
+
+  total_weight.compute_root().parallel(ty).vectorize(tx, 16);
+
+  output.compute_root().parallel(y).vectorize(x, 16);
+
+  return output;
+}
+
+/*
+ * merge_stream_init -- starts a streaming merge with the overlapping tiles of
+ * the reference frame, laid out as the output of merge_temporal. The total
+ * weight of every tile starts at 1.
+ */
+Func merge_stream_init(Func ref, Expr width, Expr height,
+                       const AlignParams &params) {
+
+  Func output("merge_stream_init_output");
+
+  Var ix, iy, tx, ty;
+
+  // mirror input with overlapping edges
+
+  Func ref_mirror = BoundaryConditions::mirror_interior(
+      ref, {Range(0, width), Range(0, height)});
+
+  output(ix, iy, tx, ty) =
+      f32(ref_mirror(idx_im(tx, ix, params), idx_im(ty, iy, params)));
+
+  return output;
+}
+
+/*
+ * merge_stream_weights -- weights of the tiles of one alternate frame in a
+ * streaming merge, computed as in merge_temporal from the finest alignment
+ * layer of the reference and the same layer of the alternate frame.
+ */
+Func merge_stream_weights(Func ref_layer, Func alt_layer, Func alignment,
+                          const AlignParams &params) {
+
+  Func output("merge_stream_weights");
+
+  Var tx, ty;
+
+  Func weight =
+      merge_temporal_weights(ref_layer, alt_layer, alignment, params);
+
+  output(tx, ty) = weight(tx, ty, 0);
+
+  return output;
+}
+
+/*
+ * merge_stream_tiles -- aligned tiles of one alternate frame, scaled by the
+ * weight of each tile, to be added to the running sums of a streaming merge.
+ */
+Func merge_stream_tiles(Func alt, Expr width, Expr height, Func alignment,
+                        Func weight, const AlignParams &params) {
+
+  Func output("merge_stream_tiles");
+
+  Var ix, iy, tx, ty;
+
+  // mirror input with overlapping edges
+
+  Func alt_mirror = BoundaryConditions::mirror_interior(
+      alt, {Range(0, width), Range(0, height)});
+
+  Point offset = P(alignment(tx, ty, 0));
+
+  Expr al_x = idx_im(tx, ix, params) + offset.x;
+  Expr al_y = idx_im(ty, iy, params) + offset.y;
+
+  output(ix, iy, tx, ty) = weight(tx, ty) * f32(alt_mirror(al_x, al_y));
+
+  return output;
+}
+
+/*
+ * merge_stream_finalize -- divides the running sums of a streaming merge by
+ * the total weight of their tile and blends the tiles spatially as merge does.
+ */
+Func merge_stream_finalize(Func accumulator, Func weight_sum,
+                           const AlignParams &params) {
+
+  Func normalized("merge_stream_normalized");
+
+  Var ix, iy, tx, ty;
+
+  normalized(ix, iy, tx, ty) =
+      accumulator(ix, iy, tx, ty) / weight_sum(tx, ty);
+
+  return merge_spatial(normalized, params);
+}
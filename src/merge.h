@@ -1,11 +1,61 @@
 #pragma once
 
 #include "Halide.h"
+#include "align.h"
 
 /*
  * merge -- fully merges aligned frames in the temporal and spatial
  * dimension to produce one denoised bayer frame.
  */
 Halide::Func merge(Halide::Func imgs, Halide::Expr width, Halide::Expr height,
-                   Halide::Expr frames, Halide::Func alignment);
+                   Halide::Expr frames, Halide::Func alignment,
+                   const AlignParams &params = AlignParams());
 Halide::Func merge(Halide::Buffer<uint16_t> imgs, Halide::Func alignment);
+
+/*
+ * merge -- merges like the above, given layer(x, y, n), the frames
+ * downsampled by box_down2 as in layer 0 of align_pyramid, instead of
+ * downsampling them again.
+ */
+Halide::Func merge(Halide::Func imgs, Halide::Func layer, Halide::Expr width,
+                   Halide::Expr height, Halide::Expr frames,
+                   Halide::Func alignment,
+                   const AlignParams &params = AlignParams());
+
+/*
+ * merge_preview -- merges aligned frames into a mosaic downsampled by factor
+ * in each dimension, for quick low resolution previews. The output keeps the
+ * bayer pattern of the input.
+ */
+Halide::Func merge_preview(Halide::Func imgs, Halide::Expr width,
+                           Halide::Expr height, Halide::Expr frames,
+                           Halide::Func alignment, Halide::Expr factor,
+                           const AlignParams &params = AlignParams());
+
+/*
+ * merge_stream_init, merge_stream_weights, merge_stream_tiles,
+ * merge_stream_finalize -- merge split into steps, for merging a burst one
+ * frame at a time. The state of a streaming merge is the running sum of the
+ * weighted, aligned tiles of all frames, indexed as (ix, iy, tx, ty) like the
+ * output of the temporal merge, and the total weight of every tile.
+ *
+ * merge_stream_init gives the initial sums from the reference frame, whose
+ * tiles have a weight of 1. merge_stream_weights gives the weights of the
+ * tiles of an alternate frame, which is aligned by align_from_layers, and
+ * merge_stream_tiles its weighted tiles; both are added to the running sums.
+ * merge_stream_finalize turns the sums into the merged bayer frame.
+ */
+Halide::Func merge_stream_init(Halide::Func ref, Halide::Expr width,
+                               Halide::Expr height,
+                               const AlignParams &params = AlignParams());
+Halide::Func merge_stream_weights(Halide::Func ref_layer,
+                                  Halide::Func alt_layer,
+                                  Halide::Func alignment,
+                                  const AlignParams &params = AlignParams());
+Halide::Func merge_stream_tiles(Halide::Func alt, Halide::Expr width,
+                                Halide::Expr height, Halide::Func alignment,
+                                Halide::Func weight,
+                                const AlignParams &params = AlignParams());
+Halide::Func merge_stream_finalize(Halide::Func accumulator,
+                                   Halide::Func weight_sum,
+                                   const AlignParams &params = AlignParams());
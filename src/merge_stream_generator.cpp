@@ -0,0 +1,168 @@
+#include <Halide.h>
+
+#include <algorithm>
+
+#include "align.h"
+#include "merge.h"
+
+namespace {
+
+/*
+ * MergeInit -- Starts a streaming merge from the reference frame. Outputs the
+ * layers of its alignment pyramid, which every later frame is aligned to, and
+ * the initial running sums of the merge.
+ */
+class MergeInit : public Halide::Generator<MergeInit> {
+public:
+  // Alignment tiles and search, see AlignParams. The three generators must be
+  // built with the same values.
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+
+  Input<Halide::Buffer<uint16_t>> reference{"reference", 2};
+
+  // Alignment pyramid of the reference, finest layer first
+  Output<Halide::Buffer<uint16_t>> layer_0{"layer_0", 2};
+  Output<Halide::Buffer<uint16_t>> layer_1{"layer_1", 2};
+  Output<Halide::Buffer<uint16_t>> layer_2{"layer_2", 2};
+
+  // Running sums of the tiles, indexed as accumulator(ix, iy, tx, ty), and
+  // total weight of every tile
+  Output<Halide::Buffer<float>> accumulator{"accumulator", 4};
+  Output<Halide::Buffer<float>> weight_sum{"weight_sum", 2};
+
+  void generate() {
+    Var x, y, n, ix, iy, tx, ty;
+
+    const AlignParams params{tile_size.value(), search_radius.value()};
+    params.Validate();
+
+    // Algorithm
+    Func frames("reference_frames");
+    frames(x, y, n) = reference(x, y);
+    std::vector<Func> layers =
+        align_pyramid(frames, reference.width(), reference.height());
+    layer_0(x, y) = layers[0](x, y, 0);
+    layer_1(x, y) = layers[1](x, y, 0);
+    layer_2(x, y) = layers[2](x, y, 0);
+
+    Func tiles = merge_stream_init(reference, reference.width(),
+                                   reference.height(), params);
+    accumulator(ix, iy, tx, ty) = tiles(ix, iy, tx, ty);
+    weight_sum(tx, ty) = 1.f;
+
+    // Schedule
+    layer_0.parallel(y).vectorize(x, 16);
+    accumulator.parallel(ty).vectorize(ix, std::min(params.tile_size, 32));
+
+    // Fails on an accumulator sized for other tiles
+    accumulator.dim(0).set_bounds(0, params.tile_size);
+    accumulator.dim(1).set_bounds(0, params.tile_size);
+  }
+};
+
+/*
+ * MergePush -- Adds one alternate frame to a streaming merge. The frame is
+ * aligned to the reference pyramid output by MergeInit, and its weighted,
+ * aligned tiles and their weights are added to the running sums. The output
+ * sums may be the same buffers as the input sums, so that they are updated in
+ * place: every point of an output only depends on the same point of the
+ * matching input.
+ */
+class MergePush : public Halide::Generator<MergePush> {
+public:
+  // As for MergeInit
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+
+  Input<Halide::Buffer<uint16_t>> frame{"frame", 2};
+
+  Input<Halide::Buffer<uint16_t>> ref_layer_0{"ref_layer_0", 2};
+  Input<Halide::Buffer<uint16_t>> ref_layer_1{"ref_layer_1", 2};
+  Input<Halide::Buffer<uint16_t>> ref_layer_2{"ref_layer_2", 2};
+
+  Input<Halide::Buffer<float>> accumulator_in{"accumulator_in", 4};
+  Input<Halide::Buffer<float>> weight_sum_in{"weight_sum_in", 2};
+
+  Output<Halide::Buffer<float>> accumulator{"accumulator", 4};
+  Output<Halide::Buffer<float>> weight_sum{"weight_sum", 2};
+
+  void generate() {
+    Var x, y, n, ix, iy, tx, ty;
+
+    Expr width = frame.width();
+    Expr height = frame.height();
+
+    const AlignParams params{tile_size.value(), search_radius.value()};
+    params.Validate();
+
+    // Algorithm
+    Func frames("alternate_frames");
+    frames(x, y, n) = frame(x, y);
+    std::vector<Func> alt_layers = align_pyramid(frames, width, height);
+
+    // The stored reference layers end at the frame; mirroring them stands in
+    // for the mirrored frame they were computed from.
+    std::vector<Func> ref_layers = {
+        Halide::BoundaryConditions::mirror_interior(ref_layer_0),
+        Halide::BoundaryConditions::mirror_interior(ref_layer_1),
+        Halide::BoundaryConditions::mirror_interior(ref_layer_2)};
+
+    Func alignment = align_from_layers(ref_layers, alt_layers, width, height,
+                                       false, params);
+    Func weight = merge_stream_weights(ref_layers[0], alt_layers[0], alignment,
+                                       params);
+    Func tiles =
+        merge_stream_tiles(frame, width, height, alignment, weight, params);
+
+    accumulator(ix, iy, tx, ty) =
+        accumulator_in(ix, iy, tx, ty) + tiles(ix, iy, tx, ty);
+    weight_sum(tx, ty) = weight_sum_in(tx, ty) + weight(tx, ty);
+
+    // Schedule
+    accumulator.parallel(ty).vectorize(ix, std::min(params.tile_size, 32));
+
+    // Fails on an accumulator sized for other tiles
+    accumulator_in.dim(0).set_bounds(0, params.tile_size);
+    accumulator_in.dim(1).set_bounds(0, params.tile_size);
+    accumulator.dim(0).set_bounds(0, params.tile_size);
+    accumulator.dim(1).set_bounds(0, params.tile_size);
+  }
+};
+
+/*
+ * MergeFinalize -- Turns the running sums of a streaming merge into the merged
+ * bayer frame, like the output of align_and_merge.
+ */
+class MergeFinalize : public Halide::Generator<MergeFinalize> {
+public:
+  // As for MergeInit
+  GeneratorParam<int> tile_size{"tile_size", HDRPLUS_TILE_SIZE};
+  GeneratorParam<int> search_radius{"search_radius",
+                                    HDRPLUS_SEARCH_RADIUS};
+
+  Input<Halide::Buffer<float>> accumulator{"accumulator", 4};
+  Input<Halide::Buffer<float>> weight_sum{"weight_sum", 2};
+
+  Output<Halide::Buffer<uint16_t>> output{"output", 2};
+
+  void generate() {
+    const AlignParams params{tile_size.value(), search_radius.value()};
+    params.Validate();
+    Func merged = merge_stream_finalize(accumulator, weight_sum, params);
+    output = merged;
+    // Schedule handled inside included functions
+
+    // Fails on an accumulator sized for other tiles
+    accumulator.dim(0).set_bounds(0, params.tile_size);
+    accumulator.dim(1).set_bounds(0, params.tile_size);
+  }
+};
+
+} // namespace
+
+HALIDE_REGISTER_GENERATOR(MergeInit, merge_init)
+HALIDE_REGISTER_GENERATOR(MergePush, merge_push)
+HALIDE_REGISTER_GENERATOR(MergeFinalize, merge_finalize)
@@ -0,0 +1,58 @@
+#include <Halide.h>
+
+namespace {
+
+using namespace Halide;
+
+/*
+ * UnpackMipi -- Unpacks MIPI CSI-2 RAW10 or RAW12 bayer rows into 16-bit
+ * samples. RAW10 stores four pixels in five bytes: the high eight bits of each
+ * pixel, then one byte holding the low two bits of all four. RAW12 stores two
+ * pixels in three bytes the same way, with four low bits per pixel.
+ */
+class UnpackMipi : public Halide::Generator<UnpackMipi> {
+public:
+  GeneratorParam<int> bits{"bits", 10};
+
+  // Packed rows of a series of frames, indexed as packed(byte, y, n). Rows
+  // and frames may be padded.
+  Input<Buffer<uint8_t>> packed{"packed", 3};
+  // Unpacked frames, indexed as output(x, y, n)
+  Output<Buffer<uint16_t>> output{"output", 3};
+
+  void generate() {
+    const int pixels = bits == 10 ? 4 : 2;
+    const int bytes = bits == 10 ? 5 : 3;
+    const int low_bits = bits - 8;
+
+    Var x, y, n;
+    Expr group = x / pixels;
+    Expr lane = x % pixels;
+    Expr high = cast<uint16_t>(packed(group * bytes + lane, y, n));
+    Expr low = cast<uint16_t>(packed(group * bytes + pixels, y, n));
+    Expr low_mask = cast<uint16_t>((1 << low_bits) - 1);
+    output(x, y, n) = (high << low_bits) |
+                      ((low >> cast<uint16_t>(lane * low_bits)) & low_mask);
+
+    ///////////////////////////////////////////////////////////////////////////
+    // schedule
+    ///////////////////////////////////////////////////////////////////////////
+
+    // The pixels of a group are unrolled so that their byte offsets and shifts
+    // are constants; across groups the packed bytes are read as strided
+    // vectors and the unpacked pixels stored densely.
+    Var xo, xi, yn;
+    output.split(x, xo, xi, pixels)
+        .unroll(xi)
+        .vectorize(xo, 16)
+        .fuse(y, n, yn)
+        .parallel(yn);
+
+    output.dim(0).set_min(0);
+    packed.dim(0).set_min(0);
+  }
+};
+
+} // namespace
+
+HALIDE_REGISTER_GENERATOR(UnpackMipi, unpack_mipi)